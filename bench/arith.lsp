@@ -0,0 +1,58 @@
+(def {t} {(* 2 3) (- 9 (+ 1 3)) (/ 8 2) (% 7 4)})
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {t} (join t t))
+(def {e} (join {+} t))
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
+(eval e)
@@ -1,12 +1,26 @@
+/* The JIT emits x86-64 code for fixnum arithmetic into mmap'd pages */
+#if defined(__x86_64__) && !defined(LILSP_NO_IMMEDIATES) && !defined(LILSP_NO_JIT)
+#define LJIT 1
+#define _DEFAULT_SOURCE
+#else
+#define LJIT 0
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#if LJIT
+#include <sys/mman.h>
+#endif
 
 #include <editline/readline.h>
 #include "include/mpc.h"
 
-#define LASSERT(args, cond, fmt, ...) \
+#define LASSERT(args, cond, code, ...) \
     if (!(cond)) { \
-        lval* err = lval_err(fmt, ##__VA_ARGS__); \
+        lval* err = lval_err(code, ##__VA_ARGS__); \
         lval_del(args); \
         return err; \
     }
@@ -14,16 +28,64 @@
 // Forward declarations
 struct lval;
 struct lenv;
+struct latom;
 typedef struct lval lval;
 typedef struct lenv lenv;
+typedef struct latom latom;
 
 /* lval types */
-enum { LVAL_LINT, LVAL_DEC, LVAL_ERR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR };
+enum { LVAL_LINT, LVAL_DEC, LVAL_ERR, LVAL_SYM, LVAL_FUN, LVAL_SEXPR, LVAL_QEXPR, LVAL_CONS };
+
+/* Error codes. An error value holds one of these and the few arguments
+ * it's message needs, the message is only put together when printed */
+enum {
+    LERR_DIV_ZERO, LERR_NUM_MISMATCH, LERR_NOT_FUNCTION,
+    LERR_UNBOUND, LERR_BAD_NUMBER, LERR_OP_NO_ARGS, LERR_NOT_NUMBER,
+    LERR_NO_ARGS, LERR_NOTHING, LERR_TOO_MANY_ARGS, LERR_ARG_COUNT,
+    LERR_ARG_TYPE, LERR_NOT_SYMBOL, LERR_VALUE_COUNT, LERR_REDEFINE,
+    LERR_MEM_LIMIT, LERR_COUNT
+};
 
-/* list of builtin function names */
-#define MAX_BUILTINS 50
-#define BUILTIN_NAME_LENGTH 10
-char builtins[MAX_BUILTINS][BUILTIN_NAME_LENGTH];
+/* List strategies: what every cell of a flat list is known to hold */
+enum { LVAL_LIST_ANY, LVAL_LIST_LINT, LVAL_LIST_DEC };
+
+/* Memory management models, selected with --gc at startup */
+enum { LMM_RC, LMM_MARK_SWEEP, LMM_GENERATIONAL, LMM_INCREMENTAL, LMM_ARENA };
+int lmm = LMM_RC;
+
+/* Builtin registry: every native builtin is one X(id, name, function)
+ * line here. It expands into the LBUILTIN_ ids below and into the table
+ * of names and functions once the builtins are defined */
+#define LILSP_BUILTINS(X) \
+    /* List funcs */ \
+    X(LIST, "list", builtin_list) \
+    X(HEAD, "head", builtin_head) \
+    X(TAIL, "tail", builtin_tail) \
+    X(EVAL, "eval", builtin_eval) \
+    X(JOIN, "join", builtin_join) \
+    X(DEF, "def", builtin_def) \
+    /* Cons lists */ \
+    X(CONS, "cons", builtin_cons) \
+    X(TO_CONS, "to-cons", builtin_to_cons) \
+    X(TO_LIST, "to-list", builtin_to_list) \
+    /* Math functions */ \
+    X(ADD, "+", builtin_add) \
+    X(SUB, "-", builtin_sub) \
+    X(MUL, "*", builtin_mul) \
+    X(DIV, "/", builtin_div) \
+    X(MOD, "%", builtin_mod) \
+    /* Comparison */ \
+    X(EQ, "==", builtin_eq) \
+    /* Runtime, these take no arguments and stay last */ \
+    X(GC_STATS, "gc-stats", builtin_gc_stats) \
+    X(ENV_STATS, "env-stats", builtin_env_stats) \
+    X(STACK_STATS, "stack-stats", builtin_stack_stats) \
+    X(STACK_FRAMES, "stack-frames", builtin_stack_frames) \
+    X(JIT_STATS, "jit-stats", builtin_jit_stats) \
+    X(MEM_STATS, "mem-stats", builtin_mem_stats)
+
+#define LBUILTIN_ID(id, name, fun) LBUILTIN_##id,
+enum { LILSP_BUILTINS(LBUILTIN_ID) LBUILTIN_COUNT };
 
 char* ltype_name(int typeName) {
     switch(typeName) {
@@ -34,35 +96,434 @@ char* ltype_name(int typeName) {
         case LVAL_SYM: return "Symbol";
         case LVAL_SEXPR: return "S-Expression";
         case LVAL_QEXPR: return "Q-Expression";
+        case LVAL_CONS: return "Cons List";
         default: return "Unknown";
     }
 }
 
 typedef lval*(*lbuiltin)(lenv*, lval*);
 
-/* lilsp value struct */
+/* lilsp value struct: a one byte type tag and a reference count followed
+ * by a union sized for the largest variant (the list), so every lval fits
+ * in 32 bytes */
 struct lval {
-    int type;
-    long lint;
-    double dec;
-    char* err;
-    char* sym;
-    lbuiltin fun;
-    /* Count and pointer to list of lvals */
-    int count;
-    struct lval** cell;
+    unsigned char type;
+    /* Collector flags, GC_MARKED, GC_REMEMBERED, GC_ARENA and the GC_EPOCH bits */
+    unsigned char mark;
+    /* 0 for a flat list, otherwise the height of a Q-Expression tree node */
+    unsigned char depth;
+    /* List strategy of a flat list, LVAL_LIST_ANY unless all it's cells
+     * are integers or all are decimals */
+    unsigned char strategy;
+    /* Number of owners: environment bindings, lists and temporaries */
+    unsigned int refs;
+    union {
+        long lint;
+        double dec;
+        /* Error: code, up to two type tags, two numbers and a name. Names
+         * are static strings or atom names, so nothing here is owned */
+        struct {
+            unsigned char ecode;
+            unsigned char etype[2];
+            int eint;
+            const char* ename;
+            long elong;
+        };
+        latom* atom;
+        lbuiltin fun;
+        /* Count and pointer to list of lvals. cell points at the first
+         * element, off slots into a buffer with room for cap pointers, so
+         * popping the front just moves cell along */
+        struct {
+            struct lval** cell;
+            int cap;
+            int off;
+            int count;
+            /* Call site number of a list read as code, 0 for lists made
+             * while evaluating. Picks the list's inline cache */
+            unsigned int site;
+        };
+        /* Q-Expression tree node: the concatenation of two shorter
+         * Q-Expressions, stored over cell, cap and off. count is shared */
+        struct {
+            struct lval* half[2];
+        };
+        /* Cons cell, laid out like half. cdr is another cons cell or the
+         * empty Q-Expression, count is the length of the list from here */
+        struct {
+            struct lval* car;
+            struct lval* cdr;
+        };
+        /* Next slot while the lval sits on a slab free list */
+        struct lval* next;
+    };
 };
 
-/* define environment strucutre */
+/* lval slab allocator: lvals are carved out of fixed size slabs and
+ * recycled through a free list per lval type, so evaluation doesn't hit
+ * malloc/free for every value it creates */
+#define LVAL_NUM_TYPES 8
+#define LVAL_SLAB_SIZE 512
+/* Type of a slab slot sitting on a free list */
+#define LVAL_FREE 0xFF
+/* Type of a nursery slot whose value was promoted, next points at the copy */
+#define LVAL_FWD 0xFE
+
+typedef struct lslab {
+    struct lslab* next;
+    lval vals[LVAL_SLAB_SIZE];
+} lslab;
+
+/* allocation counters */
+typedef struct lval_stats {
+    long live;
+    long peak;
+    long recycled;
+    long slabs;
+} lval_stats;
+
+lslab* lval_slabs = NULL;
+int lval_slab_used = LVAL_SLAB_SIZE;
+lval* lval_free_list[LVAL_NUM_TYPES];
+lval_stats lval_counters;
+/* slab lvals handed out since the last collection */
+long gc_allocated = 0;
+/* Collector flags new slab lvals start with, black while an incremental
+ * cycle is running */
+unsigned char gc_alloc_color = 0;
+
+/* Generational nursery: new lvals are bump allocated here and survivors
+ * are copied out to the slabs by a minor collection. Once it fills up
+ * values go straight to the slabs until the next safe point */
+#define GC_NURSERY_SIZE 32768
+/* Cell array bytes allocated before a minor collection even when the
+ * nursery has room, so dead lists don't hold on to their cells */
+#define GC_NURSERY_CELL_BYTES (GC_NURSERY_SIZE * (long)sizeof(lval*))
+
+lval* gc_nursery = NULL;
+int gc_nursery_used = 0;
+/* Cell array bytes after the last minor collection */
+long gc_nursery_cells_base = 0;
+
+#define GC_IS_YOUNG(v) ((v) >= gc_nursery && (v) < gc_nursery + GC_NURSERY_SIZE)
+
+/* Per-evaluation arena: with --gc=arena every lval made while evaluating
+ * one REPL line is bump allocated from these chunks and the whole lot is
+ * dropped in one go afterwards. The chunks are kept for the next line */
+#define GC_ARENA_CHUNK 4096
+/* lval.mark flag of values living in the arena */
+#define GC_ARENA 16
+/* lval.mark flag of hash-consed values, which are never modified */
+#define LVAL_HASHED 32
+/* lval.mark flag of the preallocated errors, which are never freed */
+#define LVAL_STATIC 64
+
+typedef struct larena_chunk {
+    struct larena_chunk* next;
+    lval vals[GC_ARENA_CHUNK];
+} larena_chunk;
+
+larena_chunk* gc_arena = NULL;
+larena_chunk* gc_arena_cur = NULL;
+int gc_arena_used = 0;
+
+/* Memory accounting. Live lvals are counted by lval_counters, everything
+ * they and the interpreter malloc (cell arrays, environments, interned
+ * data, bytecode and evaluator stacks) goes through lmem_alloc and friends
+ * with it's size, so usage is known at any time. With --mem-limit=N an
+ * evaluation that grows it by more than N bytes is stopped with an error
+ * at the next safe point */
+enum { LMEM_CELLS, LMEM_ENV, LMEM_INTERNED, LMEM_CODE, LMEM_STACK, LMEM_KINDS };
+
+long lmem_bytes[LMEM_KINDS];
+long lmem_peak = 0;
+/* Per evaluation limit, 0 for none, and usage when the evaluation began */
+long lmem_limit = 0;
+long lmem_base = 0;
+/* Set once the evaluation in progress has gone over the limit */
+int lmem_tripped = 0;
+
+long lmem_used(void) {
+    long n = lval_counters.live * (long)sizeof(lval);
+    for (int k = 0; k < LMEM_KINDS; k++) { n += lmem_bytes[k]; }
+    return n;
+}
+
+void lmem_note(int kind, long n) {
+    lmem_bytes[kind] += n;
+    if (n > 0 && lmem_used() > lmem_peak) { lmem_peak = lmem_used(); }
+}
+
+void* lmem_alloc(int kind, size_t n) {
+    lmem_note(kind, n);
+    return malloc(n);
+}
+
+void* lmem_calloc(int kind, size_t count, size_t n) {
+    lmem_note(kind, count * n);
+    return calloc(count, n);
+}
+
+void* lmem_realloc(int kind, void* p, size_t old, size_t n) {
+    lmem_note(kind, (long)n - (long)old);
+    return realloc(p, n);
+}
+
+void lmem_free(int kind, void* p, size_t n) {
+    lmem_note(kind, -(long)n);
+    free(p);
+}
+
+lval* gc_arena_alloc(void) {
+    if (gc_arena_cur == NULL || gc_arena_used == GC_ARENA_CHUNK) {
+        larena_chunk* c = gc_arena_cur ? gc_arena_cur->next : gc_arena;
+        if (c == NULL) {
+            c = malloc(sizeof(larena_chunk));
+            c->next = NULL;
+            if (gc_arena_cur) { gc_arena_cur->next = c; } else { gc_arena = c; }
+        }
+        gc_arena_cur = c;
+        gc_arena_used = 0;
+    }
+    lval* v = &gc_arena_cur->vals[gc_arena_used++];
+    v->mark = GC_ARENA;
+    return v;
+}
+
+/* Get a slot from the slabs, recycling a free one if possible */
+lval* lval_slab_alloc(int type) {
+    lval* v = lval_free_list[type];
+
+    // Nothing of this type to recycle and the current slab is full, so
+    // borrow a slot freed by another type before growing the heap
+    if (v == NULL && lval_slab_used == LVAL_SLAB_SIZE) {
+        for (int t = 0; t < LVAL_NUM_TYPES && v == NULL; t++) {
+            if (lval_free_list[t]) { type = t; v = lval_free_list[t]; }
+        }
+    }
+
+    if (v != NULL) {
+        lval_free_list[type] = v->next;
+        lval_counters.recycled++;
+    } else {
+        if (lval_slab_used == LVAL_SLAB_SIZE) {
+            lslab* s = malloc(sizeof(lslab));
+            s->next = lval_slabs;
+            lval_slabs = s;
+            lval_slab_used = 0;
+            lval_counters.slabs++;
+        }
+        v = &lval_slabs->vals[lval_slab_used++];
+    }
+
+    v->mark = gc_alloc_color;
+    gc_allocated++;
+    return v;
+}
+
+/* Get a fresh lval of the given type */
+lval* lval_alloc(int type) {
+    lval* v;
+    if (lmm == LMM_GENERATIONAL && gc_nursery_used < GC_NURSERY_SIZE) {
+        v = &gc_nursery[gc_nursery_used++];
+        v->mark = 0;
+    } else if (lmm == LMM_ARENA) {
+        v = gc_arena_alloc();
+    } else {
+        v = lval_slab_alloc(type);
+    }
+
+    v->refs = 1;
+    v->depth = 0;
+    v->strategy = LVAL_LIST_ANY;
+    lval_counters.live++;
+    if (lval_counters.live > lval_counters.peak) {
+        lval_counters.peak = lval_counters.live;
+    }
+    if (lmem_used() > lmem_peak) { lmem_peak = lmem_used(); }
+    return v;
+}
+
+/* Return an lval to the free list for its type */
+void lval_free(lval* v) {
+    v->next = lval_free_list[v->type];
+    lval_free_list[v->type] = v;
+    v->type = LVAL_FREE;
+    lval_counters.live--;
+}
+
+/* Snapshot of the allocator counters */
+lval_stats lval_alloc_stats(void) {
+    return lval_counters;
+}
+
+/* define environment strucutre: an open addressing hash table keyed by
+ * atom, probed linearly and doubled once it is LENV_MAX_LOAD full. The
+ * table holds pointers to cells, which never move once made, so a symbol
+ * resolved to it's cell stays valid as the table grows */
+#define LENV_MIN_SLOTS 64
+#define LENV_MAX_LOAD 0.7
+
+/* A global variable, made when the symbol is first bound. version
+ * changes whenever the variable is bound, which is what invalidates the
+ * inline caches holding on to it's value */
+typedef struct lenv_cell {
+    latom* sym;
+    lval* val;
+    unsigned int version;
+} lenv_cell;
+
 struct lenv {
+    /* Number of bindings */
     int count;
-    char** syms;
-    lval** vals;
+    /* Number of cells */
+    int cells;
+    /* Number of slots, a power of two */
+    int cap;
+    lenv_cell** slots;
 };
 
+/* Evaluators: the bytecode VM, the tree-walker kept as a reference, or
+ * the explicit stack machine for deep nesting, selected with --eval at
+ * startup */
+enum { LEVAL_VM, LEVAL_TREE, LEVAL_CEK };
+int leval = LEVAL_VM;
+
+/* Bytecode: an opcode followed by it's operands, one word each.
+ *   LOP_CONST k       push constant k
+ *   LOP_GLOBAL cell   push the value of a global variable
+ *   LOP_LOOKUP atom   push the value of a symbol that wasn't bound when
+ *                     the code was compiled, looked up every time
+ *   LOP_SINGLE        evaluate a one element S-Expression
+ *   LOP_CALL n        call the function under n arguments
+ *   LOP_ARITH op n    apply the arithmetic builtin named op to n arguments
+ *   LOP_EVAL          a tail call of eval, run the code for the Q-Expression
+ *                     on the stack in place of this code
+ *   LOP_END           stop, leaving the result on the stack */
+enum { LOP_CONST, LOP_GLOBAL, LOP_LOOKUP, LOP_SINGLE, LOP_CALL, LOP_ARITH, LOP_EVAL, LOP_END, LOP_COUNT };
+
+/* Words taken by each instruction, indexed by opcode */
+const int lop_words[LOP_COUNT] = { 2, 2, 2, 1, 2, 3, 1, 1 };
+
+/* The VM is direct-threaded with GCC and Clang: the first run of some code
+ * replaces each opcode with the address of it's handler, and every handler
+ * jumps straight to the next one. Other compilers get a switch in a loop,
+ * as does a build with -DLILSP_SWITCH_DISPATCH, to compare the two */
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(LILSP_SWITCH_DISPATCH)
+#define LVM_THREADED 1
+#else
+#define LVM_THREADED 0
+#endif
+
+typedef union lword {
+    long i;
+    void* p;
+} lword;
+
+/* Native code for a whole lcode, given scratch space for it's stack.
+ * Returns 0 with the result in *result, or 1 when a guard failed */
+typedef int (*ljit_fn)(long* slots, long* result);
+
+/* JIT states of a code */
+enum { LJIT_COLD, LJIT_NATIVE, LJIT_NEVER };
+
+typedef struct lcode {
+    lword* words;
+    int count;
+    int cap;
+    /* Most values the code has on the stack at once */
+    int stack;
+    /* Constants, held in a Q-Expression the collectors can see */
+    lval* consts;
+    /* Q-Expression the code was compiled from while it is cached */
+    lval* src;
+    /* Owners: the eval cache and whoever is running it */
+    int refs;
+    /* Opcodes have been replaced with handler addresses */
+    int threaded;
+    /* Runs while LJIT_COLD, and the mapping holding the native code once
+     * LJIT_NATIVE */
+    int jit;
+    int runs;
+    int bailouts;
+    unsigned char* native;
+    size_t native_size;
+    /* Every live code is a collector root */
+    struct lcode* prev;
+    struct lcode* next;
+} lcode;
+
+lcode* lcode_live = NULL;
+
+/* Immediate values: integers and most decimals are encoded directly in
+ * the lval* word rather than pointing at a slab. The low bits of the word
+ * tell the encodings apart:
+ *   ...000  pointer to a heap lval
+ *   .....1  fixnum, the integer shifted left by one
+ *   ....10  flonum, a double with its exponent bits rotated down (64-bit)
+ *   ...100  symbol, a pointer to it's interned atom (64-bit)
+ * Integers outside the fixnum range and doubles whose exponent can't be
+ * squeezed in still get a heap lval, so always go through the accessor
+ * macros below. Build with -DLILSP_NO_IMMEDIATES to box everything. */
+#if !defined(LILSP_NO_IMMEDIATES)
+#define LVAL_IS_FIXNUM(v) (((uintptr_t)(v) & 1) != 0)
+#if UINTPTR_MAX > 0xFFFFFFFFu
+#define LVAL_IS_FLONUM(v) (((uintptr_t)(v) & 3) == 2)
+#define LVAL_IS_ATOM(v) (((uintptr_t)(v) & 7) == 4)
+#else
+#define LVAL_IS_FLONUM(v) 0
+#define LVAL_IS_ATOM(v) 0
+#endif
+#else
+#define LVAL_IS_FIXNUM(v) 0
+#define LVAL_IS_FLONUM(v) 0
+#define LVAL_IS_ATOM(v) 0
+#endif
+
+#define LVAL_IS_IMMEDIATE(v) (LVAL_IS_FIXNUM(v) || LVAL_IS_FLONUM(v) || LVAL_IS_ATOM(v))
+#define LVAL_FIXNUM_MIN (LONG_MIN >> 1)
+#define LVAL_FIXNUM_MAX (LONG_MAX >> 1)
+
+/* Type of any lval, immediate or not */
+#define LVAL_TYPE(v) \
+    (LVAL_IS_FIXNUM(v) ? LVAL_LINT : LVAL_IS_FLONUM(v) ? LVAL_DEC : \
+     LVAL_IS_ATOM(v) ? LVAL_SYM : (v)->type)
+/* Numeric payload of an LVAL_LINT / LVAL_DEC in either encoding */
+#define LVAL_LINT_VAL(v) \
+    (LVAL_IS_FIXNUM(v) ? (long)((intptr_t)(v) >> 1) : (v)->lint)
+#define LVAL_DEC_VAL(v) \
+    (LVAL_IS_FLONUM(v) ? lval_flonum_val(v) : (v)->dec)
+/* Interned atom of an LVAL_SYM in either encoding */
+#define LVAL_ATOM(v) \
+    (LVAL_IS_ATOM(v) ? (latom*)((uintptr_t)(v) & ~(uintptr_t)7) : (v)->atom)
+
+#define LVAL_ROTL(x, n) (((x) << (n)) | ((x) >> (64 - (n))))
+#define LVAL_ROTR(x, n) (((x) >> (n)) | ((x) << (64 - (n))))
+/* Flonum encoding of +0.0, which the rotation can't represent */
+#define LVAL_FLONUM_ZERO ((uintptr_t)1 << (sizeof(uintptr_t) * 8 - 1) | 2)
+
+/* Decode a flonum back into a double */
+double lval_flonum_val(lval* v) {
+#if UINTPTR_MAX > 0xFFFFFFFFu
+    uint64_t w = (uintptr_t)v;
+    union { double d; uint64_t u; } t;
+    if (w == LVAL_FLONUM_ZERO) { return 0.0; }
+    // Restore the two exponent bits dropped by the encoding from bit 63
+    t.u = LVAL_ROTR((2 - (w >> 63)) | (w & ~(uint64_t)3), 3);
+    return t.d;
+#else
+    return 0.0;
+#endif
+}
+
 /* Create new pointer to integer type */
 lval* lval_lint(long x) {
-    lval* v = malloc(sizeof(lval));
+#if !defined(LILSP_NO_IMMEDIATES)
+    if (x >= LVAL_FIXNUM_MIN && x <= LVAL_FIXNUM_MAX) {
+        return (lval*)(((uintptr_t)x << 1) | 1);
+    }
+#endif
+    lval* v = lval_alloc(LVAL_LINT);
     v->type = LVAL_LINT;
     v->lint = x;
     return v;
@@ -70,62 +531,226 @@ lval* lval_lint(long x) {
 
 /* Create new pointer to decimal type */
 lval* lval_dec(double x) {
-    lval* v = malloc(sizeof(lval));
+#if !defined(LILSP_NO_IMMEDIATES) && UINTPTR_MAX > 0xFFFFFFFFu
+    union { double d; uint64_t u; } t;
+    t.d = x;
+    // Only exponents in the middle of the range survive the rotation
+    int bits = (int)((t.u >> 60) & 7);
+    if (t.u != 0x3000000000000000 && !((bits - 3) & ~1)) {
+        return (lval*)(uintptr_t)((LVAL_ROTL(t.u, 3) & ~(uint64_t)1) | 2);
+    }
+    if (t.u == 0) { return (lval*)LVAL_FLONUM_ZERO; }
+#endif
+    lval* v = lval_alloc(LVAL_DEC);
     v->type = LVAL_DEC;
     v->dec = x;
     return v;
 }
 
-/* Create pointer to error type */
-lval* lval_err(char* fmt, ...) {
-    lval* v = malloc(sizeof(lval));
+/* Message of each error code and the arguments lval_err takes for it,
+ * in the order the message uses them: n a name, i an int, l a long and
+ * t a type. Every argument is substituted into the message as a string */
+typedef struct lerr_info {
+    char* fmt;
+    char* args;
+} lerr_info;
+
+lerr_info lerr_table[LERR_COUNT] = {
+    [LERR_DIV_ZERO] = { "Division by zero", "" },
+    [LERR_NUM_MISMATCH] = { "Numeric types don't match.", "" },
+    [LERR_NOT_FUNCTION] = { "First element is not a function.", "" },
+    [LERR_UNBOUND] = { "Unbound symbol '%s'", "n" },
+    [LERR_BAD_NUMBER] = { "Invalid number '%s'", "n" },
+    [LERR_OP_NO_ARGS] = { "Operator '%s' passed no arguments.", "n" },
+    [LERR_NOT_NUMBER] = { "Cannot apply operator '%s' to argument of type %s. Argument must be a numeric type.", "nt" },
+    [LERR_NO_ARGS] = { "Function '%s' passed no arguments.", "n" },
+    [LERR_NOTHING] = { "Function '%s' passed nothing.", "n" },
+    [LERR_TOO_MANY_ARGS] = { "Function '%s' passed too many arguments. Got %s, expected %s.", "nii" },
+    [LERR_ARG_COUNT] = { "Function '%s' passed incorrect number of arguments. Got %s, expected %s.", "nii" },
+    [LERR_ARG_TYPE] = { "Function '%s' passed incorrect type for argument %s. Got %s, expected %s.", "nitt" },
+    [LERR_NOT_SYMBOL] = { "Function '%s' expected a symbol at argument %s, instead got %s.", "nit" },
+    [LERR_VALUE_COUNT] = { "Incorrect number of values passed. Expected %s, got %s.", "ii" },
+    [LERR_REDEFINE] = { "Cannot redefine builtin function '%s'.", "n" },
+    [LERR_MEM_LIMIT] = { "Evaluation exceeded the memory limit of %s bytes.", "l" },
+};
+
+/* Errors without arguments are always the same value, so each has one
+ * preallocated instance that is handed out instead of a new lval */
+lval lerr_static[LERR_COUNT];
+
+/* Create pointer to error type. Takes the arguments lerr_table lists for
+ * code, the first int goes in eint and a second int or a long in elong */
+lval* lval_err(int code, ...) {
+    if (lerr_table[code].args[0] == '\0') {
+        lval* v = &lerr_static[code];
+        if (v->type != LVAL_ERR) {
+            v->type = LVAL_ERR;
+            v->mark = LVAL_STATIC;
+            // Never owned, so nothing tries to modify it in place
+            v->refs = 2;
+            v->ecode = code;
+        }
+        return v;
+    }
+
+    lval* v = lval_alloc(LVAL_ERR);
     v->type = LVAL_ERR;
+    v->ecode = code;
+    v->etype[0] = v->etype[1] = 0;
+    v->eint = 0;
+    v->ename = NULL;
+    v->elong = 0;
 
-    // create va list and initialize
     va_list va;
-    va_start(va, fmt);
-
-    // allocate 512 bytes
-    v->err = malloc(512);
-    // printf error (max 511 chars)
-    vsnprintf(v->err, 511, fmt, va);
-    //reallocate number of bytes used
-    v->err = realloc(v->err, strlen(v->err)+1);
+    va_start(va, code);
+    int ints = 0, types = 0;
+    for (char* c = lerr_table[code].args; *c; c++) {
+        switch (*c) {
+            case 'n': v->ename = va_arg(va, char*); break;
+            case 't': v->etype[types++] = va_arg(va, int); break;
+            case 'l': v->elong = va_arg(va, long); break;
+            case 'i':
+                if (ints++ == 0) { v->eint = va_arg(va, int); } else { v->elong = va_arg(va, int); }
+                break;
+        }
+    }
     va_end(va);
 
     return v;
 }
 
-/* Create pointer to symbol type */
-lval* lval_sym(char* symbolName) {
-    lval* v = malloc(sizeof(lval));
+/* Render the message of an error into buf */
+void lerr_message(lval* v, char* buf, int n) {
+    lerr_info* info = &lerr_table[v->ecode];
+    char nums[4][24];
+    char* args[4] = { "", "", "", "" };
+    int ints = 0, types = 0;
+    for (int k = 0; info->args[k]; k++) {
+        switch (info->args[k]) {
+            case 'n': args[k] = (char*)v->ename; break;
+            case 't': args[k] = ltype_name(v->etype[types++]); break;
+            case 'l': snprintf(nums[k], sizeof(nums[k]), "%li", v->elong); args[k] = nums[k]; break;
+            case 'i':
+                snprintf(nums[k], sizeof(nums[k]), "%li", ints++ == 0 ? (long)v->eint : v->elong);
+                args[k] = nums[k];
+                break;
+        }
+    }
+    snprintf(buf, n, info->fmt, args[0], args[1], args[2], args[3]);
+}
+
+/* Same error code with the same arguments */
+int lerr_same(lval* a, lval* b) {
+    if (a->ecode != b->ecode || a->eint != b->eint || a->elong != b->elong) { return 0; }
+    if (a->etype[0] != b->etype[0] || a->etype[1] != b->etype[1]) { return 0; }
+    if (a->ename == b->ename) { return 1; }
+    return a->ename && b->ename && strcmp(a->ename, b->ename) == 0;
+}
+
+/* Symbol table: every symbol name is interned once into an atom that
+ * lives for the rest of the run, so symbols compare by pointer */
+struct latom {
+    char* name;
+    unsigned long hash;
+    /* Next atom in the same table bucket */
+    struct latom* next;
+    /* Cell of the global variable, once the symbol has been bound.
+     * lilsp has a single environment, so this is all a symbol needs to
+     * find it's value */
+    lenv_cell* global;
+};
+
+latom** latom_table = NULL;
+size_t latom_buckets = 0;
+size_t latom_count = 0;
+
+unsigned long latom_hash(char* name) {
+    // FNV-1a
+    unsigned long h = 2166136261u;
+    for (; *name; name++) { h = (h ^ (unsigned char)*name) * 16777619u; }
+    return h;
+}
+
+/* Find the atom for a name, creating it on first use */
+latom* latom_intern(char* name) {
+    unsigned long h = latom_hash(name);
+    if (latom_buckets > 0) {
+        for (latom* a = latom_table[h % latom_buckets]; a != NULL; a = a->next) {
+            if (a->hash == h && strcmp(a->name, name) == 0) { return a; }
+        }
+    }
+
+    // Keep chains short by doubling the buckets
+    if (latom_count >= latom_buckets) {
+        size_t buckets = latom_buckets ? latom_buckets * 2 : 256;
+        latom** table = lmem_calloc(LMEM_INTERNED, buckets, sizeof(latom*));
+        for (size_t i = 0; i < latom_buckets; i++) {
+            for (latom* a = latom_table[i], *next; a != NULL; a = next) {
+                next = a->next;
+                a->next = table[a->hash % buckets];
+                table[a->hash % buckets] = a;
+            }
+        }
+        lmem_free(LMEM_INTERNED, latom_table, latom_buckets * sizeof(latom*));
+        latom_table = table;
+        latom_buckets = buckets;
+    }
+
+    latom* a = lmem_alloc(LMEM_INTERNED, sizeof(latom));
+    a->name = lmem_alloc(LMEM_INTERNED, strlen(name) + 1);
+    strcpy(a->name, name);
+    a->hash = h;
+    a->global = NULL;
+    a->next = latom_table[h % latom_buckets];
+    latom_table[h % latom_buckets] = a;
+    latom_count++;
+    return a;
+}
+
+/* Create symbol for an interned atom */
+lval* lval_atom(latom* a) {
+#if !defined(LILSP_NO_IMMEDIATES) && UINTPTR_MAX > 0xFFFFFFFFu
+    return (lval*)((uintptr_t)a | 4);
+#else
+    lval* v = lval_alloc(LVAL_SYM);
     v->type = LVAL_SYM;
-    v->sym = malloc(strlen(symbolName) + 1);
-    strcpy(v->sym, symbolName);
+    v->atom = a;
     return v;
+#endif
+}
+
+/* Create pointer to symbol type */
+lval* lval_sym(char* symbolName) {
+    return lval_atom(latom_intern(symbolName));
 }
 
 /* Create pointer to new sexpr type */
 lval* lval_sexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc(LVAL_SEXPR);
     v->type = LVAL_SEXPR;
     v->count = 0;
+    v->cap = 0;
+    v->off = 0;
+    v->site = 0;
     v->cell = NULL;
     return v;
 }
 
 /* Create pointer to new Qexpr type */
 lval* lval_qexpr(void) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc(LVAL_QEXPR);
     v->type = LVAL_QEXPR;
     v->count = 0;
+    v->cap = 0;
+    v->off = 0;
+    v->site = 0;
     v->cell = NULL;
     return v;
 }
 
 /* create pointer to function type */
 lval* lval_fun(lbuiltin func) {
-    lval* v = malloc(sizeof(lval));
+    lval* v = lval_alloc(LVAL_FUN);
     v->type = LVAL_FUN;
     v->fun = func;
     return v;
@@ -133,433 +758,2628 @@ lval* lval_fun(lbuiltin func) {
 
 /* create pointer to new lenv type */
 lenv* lenv_new(void) {
-    lenv* e = malloc(sizeof(lenv));
+    lenv* e = lmem_alloc(LMEM_ENV, sizeof(lenv));
     e->count = 0;
-    e->syms = NULL;
-    e->vals = NULL;
+    e->cells = 0;
+    e->cap = LENV_MIN_SLOTS;
+    e->slots = lmem_calloc(LMEM_ENV, e->cap, sizeof(lenv_cell*));
     return e;
 }
 
-// Reallocate memory and add item to list of children
+// Forward declare, v is the container x is stored in, NULL for an lenv
+void gc_write_barrier(lval* v, lval* x);
+lval* gc_promote(lval* v);
+void gc_env_rehashed(void);
+lval* lval_pop(lval* v, int i);
+void lcode_cache_arena_reset(void);
+void lcode_cache_forget(void);
+void lcode_cache_flush(void);
+void gc_push(lval*** stack, int* count, int* cap, lval* v);
+
+/* Create a cons cell in front of the cons list cdr, consumes both */
+lval* lval_cons(lval* car, lval* cdr) {
+    lval* v = lval_alloc(LVAL_CONS);
+    v->type = LVAL_CONS;
+    v->car = car;
+    v->cdr = cdr;
+    v->count = cdr->count + 1;
+    gc_write_barrier(v, car);
+    gc_write_barrier(v, cdr);
+    return v;
+}
+
+/* The list strategy a single cell allows */
+int lval_strategy_of(lval* x) {
+    switch (LVAL_TYPE(x)) {
+        case LVAL_LINT: return LVAL_LIST_LINT;
+        case LVAL_DEC: return LVAL_LIST_DEC;
+        default: return LVAL_LIST_ANY;
+    }
+}
+
+// Add item to list of children, growing the buffer when it is full
 lval* lval_add(lval* v, lval* x) {
-    v->count++;
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    v->cell[v->count-1] = x;
+    // The first cell picks the strategy, a cell of another type drops it
+    int s = lval_strategy_of(x);
+    if (v->count == 0) { v->strategy = s; } else if (v->strategy != s) { v->strategy = LVAL_LIST_ANY; }
+
+    if (v->off + v->count == v->cap) {
+        lval** base = v->cell - v->off;
+        if (v->off > 0 && v->off >= v->cap / 2) {
+            // Mostly popped from the front, reuse that space
+            memmove(base, v->cell, sizeof(lval*) * v->count);
+            v->off = 0;
+        } else {
+            int cap = v->cap ? v->cap * 2 : 4;
+            base = lmem_realloc(LMEM_CELLS, base, sizeof(lval*) * v->cap, sizeof(lval*) * cap);
+            v->cap = cap;
+        }
+        v->cell = base + v->off;
+    }
+    v->cell[v->count++] = x;
+    gc_write_barrier(v, x);
     return v;
 }
 
-/* Delete an lval and free it's children's memory (if applicable) */
-void lval_del(lval* v) {
-    switch (v->type) {
-        // nothing special for numbers
-        case LVAL_LINT:
-        case LVAL_DEC: break;
+/* Values holding other lvals */
+#define LVAL_HAS_KIDS(v) ((v)->type == LVAL_SEXPR || (v)->type == LVAL_QEXPR || (v)->type == LVAL_CONS)
+/* Tree nodes and cons cells keep exactly two kids in half */
+#define LVAL_IS_PAIR(v) ((v)->depth || (v)->type == LVAL_CONS)
+/* The lval slots a list holds: it's cells, or a pair's two halves */
+#define LVAL_KIDS(v) (LVAL_IS_PAIR(v) ? (v)->half : (v)->cell)
+#define LVAL_KID_COUNT(v) (LVAL_IS_PAIR(v) ? 2 : (v)->count)
+
+// Forward declare
+void lcode_unseen(lval* v);
+
+/* Release a list's cell buffer, pairs don't have one */
+void lval_free_cells(lval* v) {
+    lcode_unseen(v);
+    if (!LVAL_IS_PAIR(v)) { lmem_free(LMEM_CELLS, v->cell - v->off, sizeof(lval*) * v->cap); }
+}
+
+/* Values whose memory is managed by reference counts: everything under
+ * --gc=rc, and whatever has been promoted out of the arena */
+#define LVAL_COUNTED(v) (!((v)->mark & LVAL_STATIC) && \
+    (lmm == LMM_RC || (lmm == LMM_ARENA && !((v)->mark & GC_ARENA))))
 
-        // For err and symbol, release string data
-        case LVAL_ERR: free(v->err); break;
-        case LVAL_SYM: free(v->sym); break;
+/* Take another reference to an lval */
+lval* lval_retain(lval* v) {
+    if (!LVAL_IS_IMMEDIATE(v)) {
+        // Under the collector the count only records that v is shared
+        if (LVAL_COUNTED(v)) { v->refs++; } else { v->refs = 2; }
+    }
+    return v;
+}
 
-        // Delete all elements within sexpr or qexpr
+/* Release the memory an lval owns directly, leaving it's children alone,
+ * and put it back on the slab */
+void lval_finalize(lval* v) {
+    switch (v->type) {
+        // Free memory allocated to hold pointers
         case LVAL_QEXPR:
-        case LVAL_SEXPR:
-        for (int i = 0; i < v->count; i++) {
-            lval_del(v->cell[i]);
+        case LVAL_SEXPR: lval_free_cells(v); break;
+    }
+    lval_free(v);
+}
+
+/* Values whose last reference has gone, waiting for lval_del to release
+ * their children. Working from this stack rather than recursing lets
+ * lval_del free lists nested any depth */
+lval** lval_dead = NULL;
+int lval_dead_count = 0;
+int lval_dead_cap = 0;
+
+/* Drop a reference to v, true if that was the last one */
+int lval_unref(lval* v) {
+    // Immediates own no memory
+    if (LVAL_IS_IMMEDIATE(v)) { return 0; }
+    // The collector's sweep or the arena reset finds dead values by itself
+    if (!LVAL_COUNTED(v)) { return 0; }
+    return --v->refs == 0;
+}
+
+/* Drop a reference to an lval, freeing it and releasing it's children
+ * once the last owner lets go */
+void lval_del(lval* v) {
+    if (!lval_unref(v)) { return; }
+
+    int base = lval_dead_count;
+    gc_push(&lval_dead, &lval_dead_count, &lval_dead_cap, v);
+    while (lval_dead_count > base) {
+        v = lval_dead[--lval_dead_count];
+        if (LVAL_HAS_KIDS(v)) {
+            for (int i = 0; i < LVAL_KID_COUNT(v); i++) {
+                lval* x = LVAL_KIDS(v)[i];
+                if (lval_unref(x)) { gc_push(&lval_dead, &lval_dead_count, &lval_dead_cap, x); }
+            }
         }
-        case LVAL_FUN: break;
-        // Free memory allocated to hold pointers
-        free(v->cell);
-        break;
+        lval_finalize(v);
     }
-    free(v);
 }
 
 /* delete an environment */
 void lenv_del(lenv* e) {
-    for (int i = 0; i < e->count; i++) {
-        free(e->syms[i]);
-        lval_del(e->vals[i]);
+    for (int i = 0; i < e->cap; i++) {
+        lenv_cell* c = e->slots[i];
+        if (c == NULL) { continue; }
+        if (c->val) { lval_del(c->val); }
+        c->sym->global = NULL;
+        lmem_free(LMEM_ENV, c, sizeof(lenv_cell));
     }
-    free(e->syms);
-    free(e->vals);
-    free(e);
+    lmem_free(LMEM_ENV, e->slots, sizeof(lenv_cell*) * e->cap);
+    lmem_free(LMEM_ENV, e, sizeof(lenv));
 }
 
-/* copy lval */
+/* copy lval. Lists are copied one level deep: the new list gets it's own
+ * cell array but shares the children, which are immutable while shared */
 lval* lval_copy(lval* v) {
-    lval*x = malloc(sizeof(lval));
-    x->type = v->type;
+    // Immediates are copied by value
+    if (LVAL_IS_IMMEDIATE(v)) { return v; }
+
+    lval* x = lval_alloc(v->type);
+    // Numbers and functions live entirely in the union, the collector
+    // flags belong to where x was allocated
+    unsigned char mark = x->mark;
+    *x = *v;
+    x->mark = mark;
+    x->refs = 1;
 
     switch(v->type) {
         case LVAL_FUN:
-            x->fun = v->fun;
-            break;
         case LVAL_DEC:
-            x->dec = v->dec;
-            break;
         case LVAL_LINT:
-            x->lint = v->lint;
             break;
 
-        // Copy strings
+        // Errors and symbols only point at strings that outlive them
         case LVAL_ERR:
-            x->err = malloc(strlen(v->err) + 1);
-            strcpy(x->err, v->err);
-            break;
-        
         case LVAL_SYM:
-            x->sym = malloc(strlen(v->sym) + 1);
-            strcpy(x->sym, v->sym);
             break;
         
-        // Copy lists recursively
+        // Share children, pairs have no cell array to copy
         case LVAL_SEXPR:
         case LVAL_QEXPR:
-            x->count = v->count;
-            x->cell = malloc(sizeof(lval*) * x->count);
-            for (int i = 0; i < x->count; i++) {
-                x->cell[i] = lval_copy(v->cell[i]);
+        case LVAL_CONS:
+            if (!LVAL_IS_PAIR(v)) {
+                x->cell = lmem_alloc(LMEM_CELLS, sizeof(lval*) * x->count);
+                x->cap = x->count;
+                x->off = 0;
+            }
+            for (int i = 0; i < LVAL_KID_COUNT(v); i++) {
+                LVAL_KIDS(x)[i] = lval_retain(LVAL_KIDS(v)[i]);
+                gc_write_barrier(x, LVAL_KIDS(x)[i]);
             }
             break;
     }
     return x;
 }
 
-/* get an item from the environment */
-lval* lenv_get(lenv* e, lval* k) {
-    // Iterate over all items
-    for (int i = 0; i < e->count; i++) {
-        if (strcmp(e->syms[i], k->sym) == 0) {
-            return lval_copy(e->vals[i]);
+/* Get an lval that is safe to modify: v itself if we are it's only owner,
+ * otherwise a copy. Consumes the caller's reference to v. In arena mode
+ * values outside the arena are never modified, so they can't end up
+ * pointing into it */
+#define LVAL_OWNED(v) ((v)->refs == 1 && !((v)->mark & LVAL_HASHED) && \
+    (lmm != LMM_ARENA || ((v)->mark & GC_ARENA)))
+
+lval* lval_unshare(lval* v) {
+    if (LVAL_IS_IMMEDIATE(v) || LVAL_OWNED(v)) { return v; }
+    lval* x = lval_copy(v);
+    lval_del(v);
+    return x;
+}
+
+/* Persistent vectors: a Q-Expression is either a flat cell array or a
+ * tree node joining two shorter Q-Expressions, kept AVL balanced by
+ * depth. Nodes are never modified once built, so join and tail make new
+ * nodes along one path and share every other subtree with their
+ * arguments, O(log n) instead of copying the whole list. Flat leaves stay
+ * as they are until something needs to take them apart: short ones are
+ * copied, long shared ones are stored as a tree of LVEC_LEAF_SIZE leaves
+ * first, once. Only eval and def flatten a tree back into one cell array */
+#define LVEC_LEAF_SIZE 32
+
+/* New tree node over l and r, consumes both */
+lval* lvec_node(lval* l, lval* r) {
+    lval* v = lval_alloc(LVAL_QEXPR);
+    v->type = LVAL_QEXPR;
+    v->half[0] = l;
+    v->half[1] = r;
+    v->count = l->count + r->count;
+    v->depth = 1 + (l->depth > r->depth ? l->depth : r->depth);
+    gc_write_barrier(v, l);
+    gc_write_barrier(v, r);
+    return v;
+}
+
+/* ((a b) c) -> (a (b c)) */
+lval* lvec_rotate_right(lval* v) {
+    lval* l = v->half[0];
+    lval* x = lvec_node(lval_retain(l->half[0]),
+        lvec_node(lval_retain(l->half[1]), lval_retain(v->half[1])));
+    lval_del(v);
+    return x;
+}
+
+/* (a (b c)) -> ((a b) c) */
+lval* lvec_rotate_left(lval* v) {
+    lval* r = v->half[1];
+    lval* x = lvec_node(lvec_node(lval_retain(v->half[0]), lval_retain(r->half[0])),
+        lval_retain(r->half[1]));
+    lval_del(v);
+    return x;
+}
+
+/* Restore balance to a node whose halves differ in depth by up to two */
+lval* lvec_balance(lval* v) {
+    lval* l = v->half[0];
+    lval* r = v->half[1];
+    if (l->depth > r->depth + 1) {
+        if (l->half[1]->depth > l->half[0]->depth) {
+            lval* x = lvec_node(lvec_rotate_left(lval_retain(l)), lval_retain(r));
+            lval_del(v);
+            v = x;
+        }
+        return lvec_rotate_right(v);
+    }
+    if (r->depth > l->depth + 1) {
+        if (r->half[0]->depth > r->half[1]->depth) {
+            lval* x = lvec_node(lval_retain(l), lvec_rotate_right(lval_retain(r)));
+            lval_del(v);
+            v = x;
         }
+        return lvec_rotate_left(v);
     }
-    return lval_err("Unbound symbol '%s'", k->sym);
+    return v;
 }
 
-/* assign a symbol to an expression */
-void lenv_put(lenv* e, lval* k, lval* v) {
-    // check if variable already exists
-    for (int i = 0; i < e->count; i++) {
-        // If variable already exists delete and replace with new value
-        if (strcmp(e->syms[i], k->sym) ==0) {
-            lval_del(e->vals[i]);
-            e->vals[i] = lval_copy(v);
-            return;
+/* Concatenate two Q-Expressions, consuming both. Short flat lists are
+ * merged into one leaf, anything else is joined as a tree */
+lval* lvec_concat(lval* l, lval* r) {
+    if (r->count == 0) { lval_del(r); return l; }
+    if (l->count == 0) { lval_del(l); return r; }
+
+    if (!l->depth && !r->depth && l->count + r->count <= LVEC_LEAF_SIZE) {
+        // Add each cell in r to l, r may be shared so leave it intact
+        l = lval_unshare(l);
+        for (int i = 0; i < r->count; i++) {
+            l = lval_add(l, lval_retain(r->cell[i]));
         }
+        lval_del(r);
+        return l;
+    }
+
+    // Walk down the side of the deeper tree until the depths meet
+    if (l->depth > r->depth) {
+        lval* a = lval_retain(l->half[0]);
+        lval* b = lval_retain(l->half[1]);
+        lval_del(l);
+        return lvec_balance(lvec_node(a, lvec_concat(b, r)));
     }
+    if (r->depth > l->depth) {
+        lval* a = lval_retain(r->half[0]);
+        lval* b = lval_retain(r->half[1]);
+        lval_del(r);
+        return lvec_balance(lvec_node(lvec_concat(l, a), b));
+    }
+    return lvec_node(l, r);
+}
 
-    // Allocate space for new entry
-    e->count++;
-    e->vals = realloc(e->vals, sizeof(lval*) * e->count);
-    e->syms = realloc(e->syms, sizeof(char*) * e->count);
-    // copy contents of lval and symbol to new location
-    e->vals[e->count-1] = lval_copy(v);
-    e->syms[e->count-1] = malloc(strlen(k->sym)+1);
-    strcpy(e->syms[e->count-1], k->sym);
+/* Balanced tree over n cells, each leaf getting it's own copy */
+lval* lvec_build(lval** cells, int n) {
+    if (n <= LVEC_LEAF_SIZE) {
+        lval* x = lval_qexpr();
+        for (int i = 0; i < n; i++) { x = lval_add(x, lval_retain(cells[i])); }
+        return x;
+    }
+    // Split on a leaf boundary so only the last leaf is short
+    int leaves = (n + LVEC_LEAF_SIZE - 1) / LVEC_LEAF_SIZE;
+    int half = leaves / 2 * LVEC_LEAF_SIZE;
+    return lvec_node(lvec_build(cells, half), lvec_build(cells + half, n - half));
 }
 
-// Forward declare
-void lval_print(lval* v);
+/* Store a long shared flat Q-Expression as a tree in place. It's owners
+ * all see the same elements, and later tails of v share the tree instead
+ * of splitting the cells again. Interned values are never modified, so
+ * they get a split copy. Consumes v */
+lval* lvec_split(lval* v) {
+    lval* t = lvec_build(v->cell, v->count);
+    if (v->mark & LVAL_HASHED) {
+        lval_del(v);
+        return t;
+    }
+
+    // The leaves hold their own references to the cells, and a value
+    // outside the arena takes copies of the halves
+    for (int i = 0; i < v->count; i++) { lval_del(v->cell[i]); }
+    lval_free_cells(v);
+    int slab = lmm == LMM_ARENA && !(v->mark & GC_ARENA);
+    v->half[0] = slab ? gc_promote(t->half[0]) : lval_retain(t->half[0]);
+    v->half[1] = slab ? gc_promote(t->half[1]) : lval_retain(t->half[1]);
+    v->depth = t->depth;
+    v->strategy = LVAL_LIST_ANY;
+    lval_del(t);
+    gc_write_barrier(v, v->half[0]);
+    gc_write_barrier(v, v->half[1]);
+    return v;
+}
+
+/* Drop the first element of a non-empty Q-Expression, consumes v */
+lval* lvec_tail(lval* v) {
+    if (v->depth) {
+        lval* l = lval_retain(v->half[0]);
+        lval* r = lval_retain(v->half[1]);
+        // Releasing v first leaves l unshared if v was it's only owner
+        lval_del(v);
+        return lvec_concat(lvec_tail(l), r);
+    }
+    if (v->count > LVEC_LEAF_SIZE && !LVAL_OWNED(v)) {
+        return lvec_tail(lvec_split(v));
+    }
+    v = lval_unshare(v);
+    lval_del(lval_pop(v, 0));
+    return v;
+}
+
+/* First element of a non-empty Q-Expression */
+lval* lvec_first(lval* v) {
+    while (v->depth) { v = v->half[0]; }
+    return v->cell[0];
+}
 
-void lval_expr_print(lval* v, char open, char close) {
-    putchar(open);
+/* Append the elements of v to the flat list x */
+void lvec_collect(lval* x, lval* v) {
+    if (v->depth) {
+        lvec_collect(x, v->half[0]);
+        lvec_collect(x, v->half[1]);
+        return;
+    }
     for (int i = 0; i < v->count; i++) {
-        // print value
-        lval_print(v->cell[i]);
+        lval_add(x, lval_retain(v->cell[i]));
+    }
+}
+
+/* Copy a tree back into a single flat Q-Expression, consumes v */
+lval* lvec_flatten(lval* v) {
+    if (!v->depth) { return v; }
+    lval* x = lval_qexpr();
+    x->cell = lmem_alloc(LMEM_CELLS, sizeof(lval*) * v->count);
+    x->cap = v->count;
+    lvec_collect(x, v);
+    lval_del(v);
+    return x;
+}
 
-        // If last element don't print trailing space
-        if (i != (v->count-1)) {
-            putchar(' ');
+/* Hash-consing: with --hash-cons, Q-Expression literals made only of
+ * numbers, symbols and other such literals are interned as they are read,
+ * so structurally equal data is one shared value and compares by pointer.
+ * Interned values are copied out to the slabs and flagged LVAL_HASHED so
+ * they are never modified in place. Like atoms they live for the rest of
+ * the run: the table holds a reference to each and is a collector root */
+#define LVAL_HASHCONS_MIN_SLOTS 256
+#define LVAL_HASHCONS_MAX_LOAD 0.7
+
+int lval_hashcons_on = 0;
+lval** lval_hashcons_slots = NULL;
+int lval_hashcons_count = 0;
+int lval_hashcons_cap = 0;
+
+/* Identity of a value inside an interned list: numbers and symbols by
+ * value, interned lists by address */
+unsigned long lval_hash_key(lval* v) {
+    if (LVAL_IS_IMMEDIATE(v)) { return (uintptr_t)v; }
+    switch (v->type) {
+        case LVAL_LINT: return (unsigned long)v->lint;
+        case LVAL_DEC: {
+            union { double d; uint64_t u; } t;
+            t.d = v->dec;
+            return (unsigned long)(t.u ^ (t.u >> 32));
         }
+        case LVAL_SYM: return (uintptr_t)v->atom;
+        default: return (uintptr_t)v;
     }
-    putchar(close);
 }
 
-/* print an lval type */
-void lval_print(lval* v) {
-    switch(v->type) {
+int lval_internable(lval* v) {
+    switch (LVAL_TYPE(v)) {
         case LVAL_LINT:
-            printf("%li", v->lint);
-            break;
         case LVAL_DEC:
-            printf("%f", v->dec);
-            break;
-        case LVAL_ERR:
-            printf("Error: %s", v->err);
-            break;
-        case LVAL_SYM:
-            printf("%s", v->sym);
-            break;
-        case LVAL_SEXPR:
-            lval_expr_print(v, '(', ')');
-            break;
-        case LVAL_QEXPR:
-            lval_expr_print(v, '{', '}');
-            break;
-        case LVAL_FUN:
-            printf("<function>");
-            break;
+        case LVAL_SYM: return 1;
+        case LVAL_QEXPR: return (v->mark & LVAL_HASHED) != 0;
+        default: return 0;
     }
 }
 
-void lval_println(lval *v) {
-    lval_print(v);
-    putchar('\n');
+unsigned long lval_hashcons_hash(lval* v) {
+    // FNV-1a over the count and the identity of each cell
+    unsigned long h = 2166136261u ^ (unsigned long)v->count;
+    for (int i = 0; i < v->count; i++) {
+        h = (h ^ lval_hash_key(v->cell[i])) * 16777619u;
+    }
+    return h;
 }
 
-lval* lval_read_num(mpc_ast_t* t) {
-    errno = 0;
-    if (strstr(t->tag, "integer")) {
-        // Check for conversion errors
-        errno = 0;
-        long x = strtol(t->contents, NULL, 10);
-        return errno != ERANGE ? lval_lint(x) : lval_err("Invalid number '%s'", t->contents);
+int lval_hashcons_same(lval* a, lval* b) {
+    if (a->count != b->count) { return 0; }
+    for (int i = 0; i < a->count; i++) {
+        if (LVAL_TYPE(a->cell[i]) != LVAL_TYPE(b->cell[i])) { return 0; }
+        if (lval_hash_key(a->cell[i]) != lval_hash_key(b->cell[i])) { return 0; }
     }
-    // Decimal type
-    if (strstr(t->tag, "decimal")) {
-        // Check for conversion errors
-        errno = 0;
-        float x = strtof(t->contents, NULL);
-        return errno != ERANGE ? lval_dec(x) : lval_err("Invalid number '%s'", t->contents);
+    return 1;
+}
+
+/* Slot holding a list equal to v, or the empty slot it would go in */
+lval** lval_hashcons_find(lval* v, unsigned long h) {
+    int i = h & (lval_hashcons_cap - 1);
+    while (lval_hashcons_slots[i] != NULL && !lval_hashcons_same(lval_hashcons_slots[i], v)) {
+        i = (i + 1) & (lval_hashcons_cap - 1);
     }
+    return &lval_hashcons_slots[i];
+}
 
-    return lval_err("Invalid number '%s'", t->contents);
+/* Reference to a cell of an interned list. Boxed numbers and symbols
+ * still in the nursery or the arena get a copy on the slabs */
+lval* lval_hashcons_cell(lval* v) {
+    if (LVAL_IS_IMMEDIATE(v) || v->mark & LVAL_HASHED) { return lval_retain(v); }
+    if (!(lmm == LMM_GENERATIONAL && GC_IS_YOUNG(v)) && !(v->mark & GC_ARENA)) { return lval_retain(v); }
+    lval* x = lval_slab_alloc(v->type);
+    *x = *v;
+    x->mark = gc_alloc_color;
+    x->refs = 1;
+    lval_counters.live++;
+    return x;
 }
 
-lval* lval_read(mpc_ast_t* t) {
-    // Return symbol or number
-    if (strstr(t->tag, "number")) { return lval_read_num(t); }
-    if (strstr(t->tag, "symbol")) { return lval_sym(t->contents); }
+/* The interned version of a freshly read Q-Expression, consumes v. Lists
+ * holding anything but numbers, symbols and interned lists come back as
+ * they are */
+lval* lval_hashcons(lval* v) {
+    for (int i = 0; i < v->count; i++) {
+        if (!lval_internable(v->cell[i])) { return v; }
+    }
 
-    // If root or sexpr, create an empty list
-    lval* x = NULL;
-    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
-    if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
-    if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+    if (lval_hashcons_count + 1 > lval_hashcons_cap * LVAL_HASHCONS_MAX_LOAD) {
+        lval** old = lval_hashcons_slots;
+        int old_cap = lval_hashcons_cap;
+        lval_hashcons_cap = old_cap ? old_cap * 2 : LVAL_HASHCONS_MIN_SLOTS;
+        lval_hashcons_slots = lmem_calloc(LMEM_INTERNED, lval_hashcons_cap, sizeof(lval*));
+        for (int i = 0; i < old_cap; i++) {
+            if (old[i]) { *lval_hashcons_find(old[i], lval_hashcons_hash(old[i])) = old[i]; }
+        }
+        lmem_free(LMEM_INTERNED, old, sizeof(lval*) * old_cap);
+    }
 
-    // Fill list with valid expressions
-    for (int i = 0; i < t->children_num; i++) {
-        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
-        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+    lval** slot = lval_hashcons_find(v, lval_hashcons_hash(v));
+    if (*slot == NULL) {
+        lval* x = lval_slab_alloc(LVAL_QEXPR);
+        x->type = LVAL_QEXPR;
+        x->mark |= LVAL_HASHED;
+        x->depth = 0;
+        x->refs = 1;
+        x->cell = lmem_alloc(LMEM_CELLS, sizeof(lval*) * v->count);
+        x->cap = v->count;
+        x->off = 0;
+        x->count = v->count;
+        x->site = 0;
+        x->strategy = v->strategy;
+        for (int i = 0; i < v->count; i++) { x->cell[i] = lval_hashcons_cell(v->cell[i]); }
+        lval_counters.live++;
+        lval_hashcons_count++;
+        *slot = x;
+    }
+    lval_del(v);
+    return lval_retain(*slot);
+}
 
-        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
-        x = lval_add(x, lval_read(t->children[i]));        
+/* find the slot holding a symbol's cell, or the empty slot it would go in */
+lenv_cell** lenv_find(lenv* e, latom* a) {
+    int i = a->hash & (e->cap - 1);
+    while (e->slots[i] != NULL && e->slots[i]->sym != a) {
+        i = (i + 1) & (e->cap - 1);
     }
-    return x;
+    return &e->slots[i];
 }
 
-// Pop item from list of lvals: remove it and shuffle other elements up
-lval* lval_pop(lval* v, int i) {
-    // get item at i
-    lval* x = v->cell[i];
+/* Double the table and rehash every cell */
+void lenv_grow(lenv* e) {
+    lenv_cell** old = e->slots;
+    int old_cap = e->cap;
 
-    // Shift memory after item
-    memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count-i-1));
+    e->cap *= 2;
+    e->slots = lmem_calloc(LMEM_ENV, e->cap, sizeof(lenv_cell*));
+    for (int i = 0; i < old_cap; i++) {
+        if (old[i]) { *lenv_find(e, old[i]->sym) = old[i]; }
+    }
+    lmem_free(LMEM_ENV, old, sizeof(lenv_cell*) * old_cap);
+    gc_env_rehashed();
+}
 
-    // Decrease count in lval
-    v->count--;
+/* The cell of a symbol's global variable, NULL if it has never been
+ * bound. Looking a symbol up never adds anything to the table */
+lenv_cell* lenv_lookup(lenv* e, latom* a) {
+    if (a->global) { return a->global; }
+    return *lenv_find(e, a);
+}
 
-    // Reallocate memory
-    v->cell = realloc(v->cell, sizeof(lval*) * v->count);
-    return x;
+/* The cell of a symbol's global variable, made the first time the symbol
+ * is bound. Only lenv_put makes cells, so the table grows with the
+ * bindings and not with the symbols that pass through it */
+lenv_cell* lenv_bind(lenv* e, latom* a) {
+    if (a->global) { return a->global; }
+
+    // Make room for new entry
+    if (e->cells + 1 > e->cap * LENV_MAX_LOAD) { lenv_grow(e); }
+    lenv_cell** s = lenv_find(e, a);
+    lenv_cell* c = lmem_alloc(LMEM_ENV, sizeof(lenv_cell));
+    c->sym = a;
+    c->val = NULL;
+    c->version = 0;
+    *s = c;
+    e->cells++;
+    a->global = c;
+    return c;
 }
 
-// Pop lval then delete remaining list
-lval* lval_take(lval* v, int i) {
-    lval* x = lval_pop(v, i);
-    lval_del(v);
-    return x;
+/* get an item from the environment */
+lval* lenv_get(lenv* e, lval* k) {
+    lenv_cell* c = lenv_lookup(e, LVAL_ATOM(k));
+    if (c && c->val) { return lval_retain(c->val); }
+    return lval_err(LERR_UNBOUND, LVAL_ATOM(k)->name);
 }
 
-// Define functionality for builtin operators
-lval* builtin_op(lenv* e, lval* a, char* op) {
-    // Ensure all args are numbers
-    for (int i = 0; i < a->count; i++) {
-        LASSERT(a, (a->cell[i]->type == LVAL_LINT || a->cell[i]->type == LVAL_DEC), "Cannot apply operator '%s' to argument of type %s. Argument must be a numeric type.", op, ltype_name(a->cell[i]->type));
-   }
+/* assign a symbol to an expression */
+void lenv_put(lenv* e, lval* k, lval* v) {
+    lenv_cell* c = lenv_bind(e, LVAL_ATOM(k));
 
-    // Pop the first element
-    lval* x = lval_pop(a, 0);
+    // If variable already exists delete and replace with new value
+    if (c->val) {
+        lval_del(c->val);
+    } else {
+        e->count++;
+    }
+    // share the value, the cell keeps the symbol's atom
+    c->val = gc_promote(v);
+    c->version++;
+    gc_write_barrier(NULL, v);
+}
 
-    // unary negation
-    if ((strcmp(op, "-") == 0) && a->count == 0) {
-        if (x->type == LVAL_LINT) {
-            x->lint = -x->lint;
-        } else {
-            x->dec = -x->dec;
+/* Call sites numbered so far */
+unsigned int lcall_sites = 0;
+
+/* Number every list in freshly read code as a call site, Q-Expressions
+ * too since they may be evaluated later. Symbols are resolved at bind
+ * time instead: lenv_bind points a symbol's atom at it's cell when it is
+ * defined, and lookups go through the atom from then on */
+lval** lval_site_work = NULL;
+int lval_site_count = 0;
+int lval_site_cap = 0;
+
+lval* lval_number_sites(lval* v) {
+    if (LVAL_TYPE(v) != LVAL_SEXPR && LVAL_TYPE(v) != LVAL_QEXPR) { return v; }
+
+    // Lists wait on a work stack, so code can be nested any depth
+    gc_push(&lval_site_work, &lval_site_count, &lval_site_cap, v);
+    while (lval_site_count > 0) {
+        lval* x = lval_site_work[--lval_site_count];
+        // Copies made to evaluate the list keep it's number
+        if (x->site == 0) {
+            x->site = ++lcall_sites;
+            if (x->site == 0) { x->site = ++lcall_sites; }
+        }
+        for (int i = 0; i < LVAL_KID_COUNT(x); i++) {
+            lval* k = LVAL_KIDS(x)[i];
+            if (LVAL_TYPE(k) == LVAL_SEXPR || LVAL_TYPE(k) == LVAL_QEXPR) {
+                gc_push(&lval_site_work, &lval_site_count, &lval_site_cap, k);
+            }
         }
     }
+    return v;
+}
 
-    // While there are elements remaining
-    while (a->count > 0) {
-        lval* y = lval_pop(a, 0);
+/* Fraction of the environment's slots in use */
+double lenv_load_factor(lenv* e) {
+    return (double)e->cells / e->cap;
+}
 
-        if (x->type != y->type) {
-            lval_del(x);
-            lval_del(y);
-            x = lval_err("Numeric types don't match.");
-            break;
-        }
+/* Mark-and-sweep collector. With --gc=mark-sweep reference counts only
+ * record whether a value may be shared (so lval_unshare still knows when to
+ * copy) and lval_del does nothing. Instead the heap is traced from the
+ * environment and the root stack at safe points in lval_eval, and every
+ * slab slot left unmarked is swept back onto the free lists. Collection
+ * never happens inside an allocation, so C code only has to root values
+ * it holds across a call to lval_eval.
+ *
+ * --gc=generational puts a nursery in front of the same heap. A minor
+ * collection copies the nursery values still reachable from the roots,
+ * from the environment and from remembered old lists into the slabs,
+ * updating every root in place, then throws the nursery away. The slabs
+ * are marked and swept as above once enough has been promoted.
+ *
+ * --gc=incremental spreads the mark and sweep over many short slices, each
+ * doing --gc-budget units of work, or more when allocation has got that
+ * far ahead of the collector since the last slice. Marking is tri-color: black
+ * values carry the current epoch, grey ones also sit on the work stack.
+ * The write barrier greys anything stored into a list or the environment
+ * while marking, new values are allocated black, and the root stack is
+ * rescanned before marking may finish. Flipping the epoch at the start of
+ * a cycle turns everything white again without touching the heap. */
+#define GC_MIN_THRESHOLD 16384
+/* Cell array bytes allocated before the first collection. Long lists are
+ * mostly cells, so they start a cycle even when few lvals are made */
+#define GC_MIN_CELL_BYTES (GC_MIN_THRESHOLD * (long)sizeof(lval))
+#define GC_DEFAULT_BUDGET 1000
+/* Units of incremental work done per allocation, which paces the slices
+ * so a cycle always finishes before the heap can run away from it. Cell
+ * array bytes count as allocations of an lval's size each */
+#define GC_WORK_PER_ALLOC 4
+/* Pause histogram buckets, bucket i counts pauses below 2^i us */
+#define GC_PAUSE_BUCKETS 20
+
+/* collector flags in lval.mark */
+#define GC_MARKED 1
+#define GC_REMEMBERED 2
+#define GC_EPOCH 12
+
+enum { GC_IDLE, GC_MARKING, GC_SWEEPING };
+
+/* Eval stack roots: addresses of locals holding lvals */
+lval*** gc_roots = NULL;
+int gc_root_count = 0;
+int gc_root_cap = 0;
+
+#define GC_ROOT(v) gc_root_push(&(v))
+
+void gc_root_push(lval** slot) {
+    if (gc_root_count == gc_root_cap) {
+        gc_root_cap = gc_root_cap ? gc_root_cap * 2 : 64;
+        gc_roots = realloc(gc_roots, sizeof(lval**) * gc_root_cap);
+    }
+    gc_roots[gc_root_count++] = slot;
+}
+
+/* collector counters, times in seconds */
+typedef struct gc_stats {
+    long collections;
+    long minor_collections;
+    long promoted;
+    long slices;
+    double pause_total;
+    double pause_max;
+    long pause_hist[GC_PAUSE_BUCKETS];
+    long bytes_reclaimed;
+} gc_stats;
+
+gc_stats gc_counters;
+long gc_threshold = GC_MIN_THRESHOLD;
+/* Cell array bytes after the last cycle, and the growth that starts the next */
+long gc_cells_base = 0;
+long gc_cells_threshold = GC_MIN_CELL_BYTES;
+
+/* Incremental cycle state */
+int gc_phase = GC_IDLE;
+unsigned char gc_epoch = 4;
+long gc_budget = GC_DEFAULT_BUDGET;
+/* Slab lvals handed out and cell array bytes when the last slice ended */
+long gc_slice_allocated = 0;
+long gc_slice_cells = 0;
+int gc_env_cursor = 0;
+lslab* gc_sweep_slab = NULL;
+int gc_sweep_index = 0;
+
+/* Lists marked or promoted but not yet scanned */
+lval** gc_work = NULL;
+int gc_work_count = 0;
+int gc_work_cap = 0;
+
+/* Old lists that have had nursery values stored in them */
+lval** gc_remembered = NULL;
+int gc_remembered_count = 0;
+int gc_remembered_cap = 0;
+
+/* Set when a nursery value is bound in the environment */
+int gc_env_dirty = 0;
+
+void gc_push(lval*** stack, int* count, int* cap, lval* v) {
+    if (*count == *cap) {
+        *cap = *cap ? *cap * 2 : 256;
+        *stack = realloc(*stack, sizeof(lval*) * *cap);
+    }
+    (*stack)[(*count)++] = v;
+}
+
+void gc_record_pause(clock_t start) {
+    double pause = (double)(clock() - start) / CLOCKS_PER_SEC;
+    gc_counters.pause_total += pause;
+    if (pause > gc_counters.pause_max) { gc_counters.pause_max = pause; }
+
+    int b = 0;
+    for (double us = 1; b < GC_PAUSE_BUCKETS-1 && pause * 1e6 >= us; us *= 2) { b++; }
+    gc_counters.pause_hist[b]++;
+}
+
+/* Grey a white value during incremental marking */
+void gc_shade(lval* v) {
+    if (LVAL_IS_IMMEDIATE(v) || (v->mark & GC_EPOCH) == gc_epoch) { return; }
+    v->mark = (v->mark & ~GC_EPOCH) | gc_epoch;
+    if (LVAL_HAS_KIDS(v)) {
+        gc_push(&gc_work, &gc_work_count, &gc_work_cap, v);
+    }
+}
+
+/* Whether the marking just finished reached v. Arena values are left
+ * to the arena */
+int gc_reached(lval* v) {
+    if (LVAL_IS_IMMEDIATE(v) || (v->mark & GC_ARENA)) { return 1; }
+    if (lmm == LMM_INCREMENTAL) { return (v->mark & GC_EPOCH) == gc_epoch; }
+    return (v->mark & GC_MARKED) != 0;
+}
+
+/* Bytes owned by a heap lval, including it's cell array */
+long lval_bytes(lval* v) {
+    long n = sizeof(lval);
+    switch (v->type) {
+        case LVAL_SEXPR:
+        case LVAL_QEXPR: n += v->depth ? 0 : sizeof(lval*) * v->cap; break;
+    }
+    return n;
+}
+
+/* Remember old lists pointing into the nursery, or grey values stored
+ * while an incremental mark is in progress */
+void gc_write_barrier(lval* v, lval* x) {
+    if (lmm == LMM_INCREMENTAL && gc_phase == GC_MARKING) {
+        gc_shade(x);
+        return;
+    }
+    if (lmm != LMM_GENERATIONAL || LVAL_IS_IMMEDIATE(x) || !GC_IS_YOUNG(x)) { return; }
+    if (v == NULL) {
+        gc_env_dirty = 1;
+    } else if (!GC_IS_YOUNG(v) && !(v->mark & GC_REMEMBERED)) {
+        v->mark |= GC_REMEMBERED;
+        gc_push(&gc_remembered, &gc_remembered_count, &gc_remembered_cap, v);
+    }
+}
+
+/* Point a slot at the promoted copy of a nursery value, copying it out
+ * first if this is the first reference seen */
+void gc_forward(lval** slot) {
+    lval* v = *slot;
+    if (LVAL_IS_IMMEDIATE(v) || !GC_IS_YOUNG(v)) { return; }
+
+    if (v->type != LVAL_FWD) {
+        lval* x = lval_slab_alloc(v->type);
+        *x = *v;
+        x->mark = 0;
+        v->type = LVAL_FWD;
+        v->next = x;
+        gc_counters.promoted++;
+        if (LVAL_HAS_KIDS(x)) {
+            gc_push(&gc_work, &gc_work_count, &gc_work_cap, x);
+        }
+    }
+    *slot = v->next;
+}
+
+void gc_minor(lenv* e) {
+    clock_t start = clock();
+
+    for (int i = 0; i < gc_root_count; i++) { gc_forward(gc_roots[i]); }
+    for (lcode* c = lcode_live; c != NULL; c = c->next) {
+        gc_forward(&c->consts);
+        if (c->src) { gc_forward(&c->src); }
+    }
+    if (gc_env_dirty) {
+        for (int i = 0; i < e->cap; i++) {
+            if (e->slots[i] && e->slots[i]->val) { gc_forward(&e->slots[i]->val); }
+        }
+        gc_env_dirty = 0;
+    }
+    for (int i = 0; i < gc_remembered_count; i++) {
+        lval* v = gc_remembered[i];
+        v->mark &= ~GC_REMEMBERED;
+        for (int j = 0; j < LVAL_KID_COUNT(v); j++) { gc_forward(&LVAL_KIDS(v)[j]); }
+    }
+    gc_remembered_count = 0;
+
+    // Promoted lists may still point into the nursery
+    while (gc_work_count > 0) {
+        lval* v = gc_work[--gc_work_count];
+        for (int i = 0; i < LVAL_KID_COUNT(v); i++) { gc_forward(&LVAL_KIDS(v)[i]); }
+    }
+
+    // Whatever wasn't promoted is dead, release it's cells
+    for (int i = 0; i < gc_nursery_used; i++) {
+        lval* v = &gc_nursery[i];
+        if (v->type == LVAL_FWD) { continue; }
+        gc_counters.bytes_reclaimed += lval_bytes(v);
+        if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) { lval_free_cells(v); }
+        lval_counters.live--;
+    }
+    gc_nursery_used = 0;
+    gc_nursery_cells_base = lmem_bytes[LMEM_CELLS];
+
+    gc_counters.minor_collections++;
+    gc_record_pause(start);
+}
+
+void gc_mark(lval* v) {
+    if (v == NULL || LVAL_IS_IMMEDIATE(v) || (v->mark & GC_MARKED)) { return; }
+    v->mark |= GC_MARKED;
+
+    // Lists are scanned later, so deep nesting doesn't recurse in C
+    if (LVAL_HAS_KIDS(v)) {
+        gc_push(&gc_work, &gc_work_count, &gc_work_cap, v);
+    }
+}
+
+/* Whether enough has been allocated since the last cycle for another,
+ * counting slab lvals and the bytes of cell arrays separately */
+int gc_due(void) {
+    return gc_allocated >= gc_threshold || lmem_bytes[LMEM_CELLS] - gc_cells_base >= gc_cells_threshold;
+}
+
+/* Let the heap double before the next collection, lvals and cells alike */
+void gc_cycle_done(void) {
+    gc_allocated = 0;
+    gc_threshold = lval_counters.live > GC_MIN_THRESHOLD ? lval_counters.live : GC_MIN_THRESHOLD;
+    gc_cells_base = lmem_bytes[LMEM_CELLS];
+    gc_cells_threshold = gc_cells_base > GC_MIN_CELL_BYTES ? gc_cells_base : GC_MIN_CELL_BYTES;
+    gc_nursery_cells_base = gc_cells_base;
+}
+
+void gc_collect(lenv* e) {
+    clock_t start = clock();
+
+    // Mark everything reachable from the environment and the eval stack
+    for (int i = 0; i < e->cap; i++) {
+        if (e->slots[i]) { gc_mark(e->slots[i]->val); }
+    }
+    for (int i = 0; i < gc_root_count; i++) { gc_mark(*gc_roots[i]); }
+    for (lcode* c = lcode_live; c != NULL; c = c->next) { gc_mark(c->consts); }
+    for (int i = 0; i < lval_hashcons_cap; i++) { gc_mark(lval_hashcons_slots[i]); }
+
+    // The arena owns it's references to promoted values until the next
+    // reset, reachable from a root or not
+    for (larena_chunk* c = gc_arena; c != NULL && gc_arena_cur != NULL; c = c->next) {
+        int used = (c == gc_arena_cur) ? gc_arena_used : GC_ARENA_CHUNK;
+        for (int i = 0; i < used; i++) {
+            lval* v = &c->vals[i];
+            if (!LVAL_HAS_KIDS(v)) { continue; }
+            for (int j = 0; j < LVAL_KID_COUNT(v); j++) {
+                lval* x = LVAL_KIDS(v)[j];
+                if (!LVAL_IS_IMMEDIATE(x) && !(x->mark & GC_ARENA)) { gc_mark(x); }
+            }
+        }
+        if (c == gc_arena_cur) { break; }
+    }
+
+    while (gc_work_count > 0) {
+        lval* v = gc_work[--gc_work_count];
+        for (int i = 0; i < LVAL_KID_COUNT(v); i++) { gc_mark(LVAL_KIDS(v)[i]); }
+    }
+    lcode_cache_forget();
+
+    // Sweep every slab; only the newest one is partly used
+    for (lslab* s = lval_slabs; s != NULL; s = s->next) {
+        int used = (s == lval_slabs) ? lval_slab_used : LVAL_SLAB_SIZE;
+        for (int i = 0; i < used; i++) {
+            lval* v = &s->vals[i];
+            if (v->type == LVAL_FREE) { continue; }
+            if (v->mark & GC_MARKED) {
+                v->mark &= ~GC_MARKED;
+            } else {
+                gc_counters.bytes_reclaimed += lval_bytes(v);
+                lval_finalize(v);
+            }
+        }
+    }
+
+    gc_cycle_done();
+    gc_counters.collections++;
+    gc_record_pause(start);
+}
+
+/* Growing the environment moves bindings around under the cursor, so
+ * start the scan of it over */
+void gc_env_rehashed(void) {
+    gc_env_cursor = 0;
+}
+
+/* Units of work owed for what has been allocated since the last slice */
+long gc_slice_debt(void) {
+    long cells = lmem_bytes[LMEM_CELLS] - gc_slice_cells;
+    long allocated = gc_allocated - gc_slice_allocated + (cells > 0 ? cells / (long)sizeof(lval) : 0);
+    return allocated * GC_WORK_PER_ALLOC;
+}
+
+/* One bounded step of an incremental cycle */
+void gc_slice(lenv* e) {
+    clock_t start = clock();
+    long work = 0;
+    long budget = gc_budget;
+    if (gc_phase != GC_IDLE && gc_slice_debt() > budget) { budget = gc_slice_debt(); }
+
+    if (gc_phase == GC_IDLE) {
+        // New cycle: every value still carries the old epoch, so is white
+        gc_epoch = (gc_epoch == 4) ? 8 : 4;
+        gc_alloc_color = gc_epoch;
+        gc_env_cursor = 0;
+        gc_phase = GC_MARKING;
+        // Interned values are roots, later ones are allocated black
+        for (int i = 0; i < lval_hashcons_cap; i++) {
+            if (lval_hashcons_slots[i]) { gc_shade(lval_hashcons_slots[i]); }
+        }
+        work += lval_hashcons_count;
+    }
+
+    while (gc_phase == GC_MARKING && work < budget) {
+        if (gc_work_count > 0) {
+            lval* v = gc_work[--gc_work_count];
+            for (int i = 0; i < LVAL_KID_COUNT(v); i++) { gc_shade(LVAL_KIDS(v)[i]); }
+            work += 1 + LVAL_KID_COUNT(v);
+        } else if (gc_env_cursor < e->cap) {
+            lenv_cell* c = e->slots[gc_env_cursor++];
+            if (c && c->val) { gc_shade(c->val); }
+            work++;
+        } else {
+            // Nothing grey left. The root stack isn't behind a barrier,
+            // so marking is only done once rescanning it greys nothing
+            for (int i = 0; i < gc_root_count; i++) {
+                if (*gc_roots[i]) { gc_shade(*gc_roots[i]); }
+            }
+            for (lcode* c = lcode_live; c != NULL; c = c->next) { gc_shade(c->consts); }
+            work += gc_root_count;
+            if (gc_work_count == 0) {
+                lcode_cache_forget();
+                gc_phase = GC_SWEEPING;
+                gc_sweep_slab = lval_slabs;
+                gc_sweep_index = 0;
+            }
+        }
+    }
+
+    while (gc_phase == GC_SWEEPING && work < budget) {
+        if (gc_sweep_slab == NULL) {
+            gc_phase = GC_IDLE;
+            gc_alloc_color = 0;
+            gc_cycle_done();
+            gc_counters.collections++;
+            break;
+        }
+
+        lslab* s = gc_sweep_slab;
+        int used = (s == lval_slabs) ? lval_slab_used : LVAL_SLAB_SIZE;
+        for (; gc_sweep_index < used && work < budget; gc_sweep_index++, work++) {
+            lval* v = &s->vals[gc_sweep_index];
+            if (v->type == LVAL_FREE || (v->mark & GC_EPOCH) == gc_epoch) { continue; }
+            gc_counters.bytes_reclaimed += lval_bytes(v);
+            lval_finalize(v);
+        }
+        if (gc_sweep_index == used) {
+            gc_sweep_slab = s->next;
+            gc_sweep_index = 0;
+        }
+    }
+
+    gc_slice_allocated = gc_allocated;
+    gc_slice_cells = lmem_bytes[LMEM_CELLS];
+    gc_counters.slices++;
+    gc_record_pause(start);
+}
+
+/* Slab copy of an arena value, still pointing at the arena's kids. The
+ * arena keeps it's own cells, so a flat list gets a copy of them */
+lval* gc_promote_copy(lval* v) {
+    lval* x = lval_slab_alloc(v->type);
+    *x = *v;
+    x->mark = 0;
+    x->refs = 1;
+    if ((v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) && !v->depth) {
+        x->cell = lmem_alloc(LMEM_CELLS, sizeof(lval*) * v->count);
+        if (v->count > 0) { memcpy(x->cell, v->cell, sizeof(lval*) * v->count); }
+        x->cap = v->count;
+        x->off = 0;
+    }
+    lval_counters.live++;
+    gc_counters.promoted++;
+    return x;
+}
+
+/* Copies whose kids may still be in the arena */
+lval** gc_promote_work = NULL;
+int gc_promote_count = 0;
+int gc_promote_cap = 0;
+
+/* Take a reference to v for the environment. In arena mode that means
+ * copying whatever is still in the arena out to the slabs */
+lval* gc_promote(lval* v) {
+    if (lmm != LMM_ARENA || LVAL_IS_IMMEDIATE(v) || !(v->mark & GC_ARENA)) {
+        return lval_retain(v);
+    }
+
+    // Copies wait on a work stack rather than being recursed on, as lists
+    // may be nested deep and cons lists run long
+    lval* x = gc_promote_copy(v);
+    int base = gc_promote_count;
+    if (LVAL_HAS_KIDS(x)) { gc_push(&gc_promote_work, &gc_promote_count, &gc_promote_cap, x); }
+    while (gc_promote_count > base) {
+        lval* p = gc_promote_work[--gc_promote_count];
+        for (int i = 0; i < LVAL_KID_COUNT(p); i++) {
+            lval* k = LVAL_KIDS(p)[i];
+            if (LVAL_IS_IMMEDIATE(k) || !(k->mark & GC_ARENA)) {
+                LVAL_KIDS(p)[i] = lval_retain(k);
+                continue;
+            }
+            lval* c = gc_promote_copy(k);
+            LVAL_KIDS(p)[i] = c;
+            if (LVAL_HAS_KIDS(c)) { gc_push(&gc_promote_work, &gc_promote_count, &gc_promote_cap, c); }
+        }
+    }
+    return x;
+}
+
+/* Drop everything allocated in the arena since the last reset */
+void gc_arena_reset(void) {
+    clock_t start = clock();
+
+    // Some cached code refers to what is about to go
+    lcode_cache_arena_reset();
+
+    for (larena_chunk* c = gc_arena; c != NULL; c = c->next) {
+        int used = (c == gc_arena_cur) ? gc_arena_used : GC_ARENA_CHUNK;
+        for (int i = 0; i < used; i++) {
+            lval* v = &c->vals[i];
+            gc_counters.bytes_reclaimed += lval_bytes(v);
+            switch (v->type) {
+                case LVAL_SEXPR:
+                case LVAL_QEXPR:
+                case LVAL_CONS:
+                    // Release references the arena holds to promoted values
+                    for (int j = 0; j < LVAL_KID_COUNT(v); j++) {
+                        lval* x = LVAL_KIDS(v)[j];
+                        if (!LVAL_IS_IMMEDIATE(x) && !(x->mark & GC_ARENA)) { lval_del(x); }
+                    }
+                    lval_free_cells(v);
+                    break;
+            }
+            lval_counters.live--;
+        }
+        if (c == gc_arena_cur) { break; }
+    }
+    gc_arena_cur = NULL;
+    gc_arena_used = 0;
+
+    gc_counters.collections++;
+    gc_record_pause(start);
+}
+
+/* Release the whole heap at exit. Under the collector garbage keeps it's
+ * cells until a sweep gets to it, so whatever the last cycle didn't reach
+ * is freed here along with the slabs, the nursery and the arena chunks */
+void gc_free_heap(void) {
+    for (int i = 0; i < gc_nursery_used; i++) {
+        lval* v = &gc_nursery[i];
+        if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) { lval_free_cells(v); }
+    }
+    gc_nursery_used = 0;
+    free(gc_nursery);
+    gc_nursery = NULL;
+
+    while (gc_arena != NULL) {
+        larena_chunk* c = gc_arena;
+        gc_arena = c->next;
+        free(c);
+    }
+    gc_arena_cur = NULL;
+
+    while (lval_slabs != NULL) {
+        lslab* s = lval_slabs;
+        for (int i = 0; i < lval_slab_used; i++) {
+            lval* v = &s->vals[i];
+            if (v->type == LVAL_SEXPR || v->type == LVAL_QEXPR) { lval_free_cells(v); }
+        }
+        lval_slabs = s->next;
+        lval_slab_used = LVAL_SLAB_SIZE;
+        free(s);
+    }
+    memset(lval_free_list, 0, sizeof(lval_free_list));
+}
+
+/* Collect everything that is garbage right now */
+void gc_reclaim(lenv* e) {
+    if (lmm == LMM_INCREMENTAL) {
+        do { gc_slice(e); } while (gc_phase != GC_IDLE);
+    } else if (lmm == LMM_MARK_SWEEP || lmm == LMM_GENERATIONAL) {
+        if (gc_nursery_used > 0) { gc_minor(e); }
+        gc_collect(e);
+    }
+}
+
+/* Whether the evaluation in progress has grown past the memory limit.
+ * Garbage the collector hasn't got to yet doesn't count against it */
+int lmem_over_limit(lenv* e) {
+    if (lmem_limit == 0 || lmem_tripped) { return lmem_tripped; }
+    if (lmem_used() - lmem_base <= lmem_limit) { return 0; }
+    // Cached code counts like anything else, but can be made again
+    lcode_cache_flush();
+    gc_reclaim(e);
+    lmem_tripped = lmem_used() - lmem_base > lmem_limit;
+    return lmem_tripped;
+}
+
+/* Called where every live value is reachable from e or the root stack */
+void gc_safepoint(lenv* e) {
+    if (lmm == LMM_INCREMENTAL) {
+        if (gc_phase == GC_IDLE ? gc_due() : gc_slice_debt() >= gc_budget) {
+            gc_slice(e);
+        }
+        return;
+    }
+    if (lmm == LMM_GENERATIONAL && (gc_nursery_used == GC_NURSERY_SIZE ||
+            lmem_bytes[LMEM_CELLS] - gc_nursery_cells_base >= GC_NURSERY_CELL_BYTES)) {
+        gc_minor(e);
+    }
+    if (lmm != LMM_RC && gc_due()) {
+        // The slabs are only swept with an empty nursery
+        if (gc_nursery_used > 0) { gc_minor(e); }
+        gc_collect(e);
+    }
+}
+
+/* Lists being printed, each with the next of it's elements to print and
+ * the bracket that closes it. A list stored as a tree has a frame for each
+ * node on the way down, with no bracket. Kept on a heap stack so input
+ * nested as deep as lval_read_text allows can be echoed back */
+typedef struct lprint_frame {
+    lval* v;
+    int i;
+    char close;
+} lprint_frame;
+
+lprint_frame* lval_print_open = NULL;
+int lval_print_cap = 0;
+
+void lval_print_push(int depth, lval* v, char close) {
+    if (depth == lval_print_cap) {
+        lval_print_cap = lval_print_cap ? lval_print_cap * 2 : 64;
+        lval_print_open = realloc(lval_print_open, sizeof(lprint_frame) * lval_print_cap);
+    }
+    lval_print_open[depth] = (lprint_frame){ v, 0, close };
+}
+
+/* print an lval type */
+void lval_print(lval* v) {
+    int depth = 0;
+    // Whether the next element needs a space before it
+    int sep = 0;
+
+    for (;;) {
+        if (v != NULL) {
+            if (sep) { putchar(' '); }
+            sep = 1;
+            switch(LVAL_TYPE(v)) {
+                case LVAL_LINT:
+                    printf("%li", LVAL_LINT_VAL(v));
+                    break;
+                case LVAL_DEC:
+                    printf("%f", LVAL_DEC_VAL(v));
+                    break;
+                case LVAL_ERR: {
+                    char msg[512];
+                    lerr_message(v, msg, sizeof(msg));
+                    printf("Error: %s", msg);
+                    break;
+                }
+                case LVAL_SYM:
+                    printf("%s", LVAL_ATOM(v)->name);
+                    break;
+                case LVAL_SEXPR:
+                    putchar('(');
+                    lval_print_push(depth++, v, ')');
+                    sep = 0;
+                    break;
+                case LVAL_QEXPR:
+                    putchar('{');
+                    lval_print_push(depth++, v, '}');
+                    sep = 0;
+                    break;
+                case LVAL_CONS:
+                    // Cons lists print in square brackets
+                    putchar('[');
+                    lval_print_push(depth++, v, ']');
+                    sep = 0;
+                    break;
+                case LVAL_FUN:
+                    printf("<function>");
+                    break;
+            }
+            v = NULL;
+        }
+
+        if (depth == 0) { break; }
+        lprint_frame* f = &lval_print_open[depth - 1];
+
+        // Go on to the frame's next element, or close it
+        if (f->close == ']') {
+            if (f->v->type == LVAL_CONS) {
+                v = f->v->car;
+                f->v = f->v->cdr;
+                continue;
+            }
+        } else if (f->v->depth) {
+            if (f->i < 2) {
+                lval_print_push(depth++, f->v->half[f->i++], 0);
+                continue;
+            }
+        } else if (f->i < f->v->count) {
+            v = f->v->cell[f->i++];
+            continue;
+        }
+        depth--;
+        if (f->close) {
+            putchar(f->close);
+            sep = 1;
+        }
+    }
+}
+
+void lval_println(lval *v) {
+    lval_print(v);
+    putchar('\n');
+}
+
+/* Number from it's text, which goes away after reading, so an error names
+ * the number through an atom */
+lval* lval_read_number(char* text, int decimal) {
+    // Check for conversion errors
+    errno = 0;
+    if (!decimal) {
+        long x = strtol(text, NULL, 10);
+        return errno != ERANGE ? lval_lint(x) : lval_err(LERR_BAD_NUMBER, latom_intern(text)->name);
+    }
+    float x = strtof(text, NULL);
+    return errno != ERANGE ? lval_dec(x) : lval_err(LERR_BAD_NUMBER, latom_intern(text)->name);
+}
+
+lval* lval_read_num(mpc_ast_t* t) {
+    if (strstr(t->tag, "integer")) { return lval_read_number(t->contents, 0); }
+    if (strstr(t->tag, "decimal")) { return lval_read_number(t->contents, 1); }
+    return lval_err(LERR_BAD_NUMBER, latom_intern(t->contents)->name);
+}
+
+lval* lval_read(mpc_ast_t* t) {
+    // Return symbol or number
+    if (strstr(t->tag, "number")) { return lval_read_num(t); }
+    if (strstr(t->tag, "symbol")) { return lval_atom(latom_intern(t->contents)); }
+
+    // If root or sexpr, create an empty list
+    lval* x = NULL;
+    if (strcmp(t->tag, ">") == 0) { x = lval_sexpr(); }
+    if (strstr(t->tag, "sexpr")) { x = lval_sexpr(); }
+    if (strstr(t->tag, "qexpr")) { x = lval_qexpr(); }
+
+    // Fill list with valid expressions
+    for (int i = 0; i < t->children_num; i++) {
+        if (strcmp(t->children[i]->contents, "(") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, ")") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, "{") == 0) { continue; }
+        if (strcmp(t->children[i]->contents, "}") == 0) { continue; }
+
+        if (strcmp(t->children[i]->tag, "regex") == 0) { continue; }
+        x = lval_add(x, lval_read(t->children[i]));        
+    }
+    if (lval_hashcons_on && x->type == LVAL_QEXPR) { x = lval_hashcons(x); }
+    return x;
+}
+
+/* Iterative reader for --eval=cek. mpc recurses for every level of
+ * nesting, this reads the same grammar into the same values as lval_read
+ * but keeps the lists it is filling on a heap stack, so input can be
+ * nested as deep as memory allows */
+lval** lval_read_open = NULL;
+int lval_read_count = 0;
+int lval_read_cap = 0;
+
+int lval_read_digit(char c) { return c >= '0' && c <= '9'; }
+
+/* Characters of the grammar's symbol rule */
+int lval_read_symbol_char(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || lval_read_digit(c) ||
+        (c != '\0' && strchr("_+-*/\\=<>!&%", c) != NULL);
+}
+
+/* Add the token from p to q to the list being filled. The input is
+ * terminated at q while it is read, then put back */
+void lval_read_token(char* p, char* q, int number, int decimal) {
+    char c = *q;
+    *q = '\0';
+    lval* x = number ? lval_read_number(p, decimal) : lval_atom(latom_intern(p));
+    *q = c;
+    lval_add(lval_read_open[lval_read_count - 1], x);
+}
+
+/* Read a line of input into an S-Expression of everything on it. On a
+ * syntax error returns NULL and points *err at the character at fault */
+lval* lval_read_text(char* s, char** err) {
+    lval_read_count = 0;
+    gc_push(&lval_read_open, &lval_read_count, &lval_read_cap, lval_sexpr());
+
+    char* p = s;
+    for (;;) {
+        while (*p != '\0' && strchr(" \t\n\r\v\f", *p) != NULL) { p++; }
+        lval* top = lval_read_open[lval_read_count - 1];
+
+        if (*p == '\0') {
+            if (lval_read_count > 1) { break; }
+            lval_read_count = 0;
+            return top;
+        }
+
+        if (*p == '(' || *p == '{') {
+            gc_push(&lval_read_open, &lval_read_count, &lval_read_cap, *p == '(' ? lval_sexpr() : lval_qexpr());
+            p++;
+            continue;
+        }
+
+        if (*p == ')' || *p == '}') {
+            if (lval_read_count == 1 || top->type != (*p == ')' ? LVAL_SEXPR : LVAL_QEXPR)) { break; }
+            lval_read_count--;
+            if (lval_hashcons_on && top->type == LVAL_QEXPR) { top = lval_hashcons(top); }
+            lval_add(lval_read_open[lval_read_count - 1], top);
+            p++;
+            continue;
+        }
+
+        // Numbers are tried before symbols, as in the grammar
+        char* q = (*p == '-') ? p + 1 : p;
+        if (lval_read_digit(*q)) {
+            while (lval_read_digit(*q)) { q++; }
+            int decimal = *q == '.' && lval_read_digit(q[1]);
+            if (decimal) {
+                q++;
+                while (lval_read_digit(*q)) { q++; }
+            }
+            lval_read_token(p, q, 1, decimal);
+            p = q;
+            continue;
+        }
+
+        q = p;
+        while (lval_read_symbol_char(*q)) { q++; }
+        if (q == p) { break; }
+        lval_read_token(p, q, 0, 0);
+        p = q;
+    }
+
+    // Syntax error, none of the open lists are in another yet
+    *err = p;
+    while (lval_read_count > 0) { lval_del(lval_read_open[--lval_read_count]); }
+    return NULL;
+}
+
+// Pop item from list of lvals: remove it and shuffle other elements up.
+// Popping the front only moves the start of the list
+lval* lval_pop(lval* v, int i) {
+    // get item at i
+    lval* x = v->cell[i];
+
+    if (i == 0) {
+        v->cell++;
+        v->off++;
+    } else {
+        // Shift memory after item
+        memmove(&v->cell[i], &v->cell[i + 1], sizeof(lval*) * (v->count-i-1));
+    }
+
+    // Decrease count in lval
+    v->count--;
+    return x;
+}
+
+// Pop lval then delete remaining list
+lval* lval_take(lval* v, int i) {
+    lval* x = lval_pop(v, i);
+    lval_del(v);
+    return x;
+}
+
+/* Apply an arithmetic operator to count arguments of the given list
+ * strategy. Leaves the arguments alone, so both builtin_op and the VM
+ * can use it */
+lval* lval_arith(char* op, lval** args, int count, int strategy) {
+    if (count == 0) { return lval_err(LERR_OP_NO_ARGS, op); }
+
+    // Lists known to be all integers or all decimals need no checking
+    int type = strategy == LVAL_LIST_LINT ? LVAL_LINT : strategy == LVAL_LIST_DEC ? LVAL_DEC : -1;
+    if (type < 0) {
+        // Ensure all args are numbers
+        for (int i = 0; i < count; i++) {
+            if (LVAL_TYPE(args[i]) != LVAL_LINT && LVAL_TYPE(args[i]) != LVAL_DEC) {
+                return lval_err(LERR_NOT_NUMBER, op, LVAL_TYPE(args[i]));
+            }
+        }
+
+        // All arguments must share the type of the first
+        type = LVAL_TYPE(args[0]);
+        for (int i = 1; i < count; i++) {
+            if (LVAL_TYPE(args[i]) != type) { return lval_err(LERR_NUM_MISMATCH); }
+        }
+    }
+    char o = op[0];
+
+    // Accumulate in a local rather than in a heap cell
+    if (type == LVAL_LINT) {
+        long x = LVAL_LINT_VAL(args[0]);
+
+        // unary negation
+        if (o == '-' && count == 1) { x = -x; }
+
+        for (int i = 1; i < count; i++) {
+            long y = LVAL_LINT_VAL(args[i]);
+            switch (o) {
+                case '+': x += y; break;
+                case '-': x -= y; break;
+                case '*': x *= y; break;
+                case '/':
+                    if (y == 0) { return lval_err(LERR_DIV_ZERO); }
+                    x /= y;
+                    break;
+                case '%':
+                    if (y == 0) { return lval_err(LERR_DIV_ZERO); }
+                    x %= y;
+                    break;
+            }
+        }
+        return lval_lint(x);
+    }
+
+    double x = LVAL_DEC_VAL(args[0]);
+
+    // unary negation
+    if (o == '-' && count == 1) { x = -x; }
+
+    for (int i = 1; i < count; i++) {
+        double y = LVAL_DEC_VAL(args[i]);
+        switch (o) {
+            case '+': x += y; break;
+            case '-': x -= y; break;
+            case '*': x *= y; break;
+            case '/':
+                if (y == 0) { return lval_err(LERR_DIV_ZERO); }
+                x /= y;
+                break;
+            case '%':
+                if (y == 0) { return lval_err(LERR_DIV_ZERO); }
+                x = fmod(x, y);
+                break;
+        }
+    }
+    return lval_dec(x);
+}
+
+// Define functionality for builtin operators
+lval* builtin_op(lenv* e, lval* a, char* op) {
+    lval* x = lval_arith(op, a->cell, a->count, a->strategy);
+    lval_del(a);
+    return x;
+}
+
+/* Builtin operators */
+lval* builtin_add(lenv* e, lval* a) {
+    return builtin_op(e, a, "+");
+}
+
+lval* builtin_sub(lenv* e, lval* a) {
+    return builtin_op(e, a, "-");
+}
+
+lval* builtin_mul(lenv* e, lval* a) {
+    return builtin_op(e, a, "*");
+}
+
+lval* builtin_div(lenv* e, lval* a) {
+    return builtin_op(e, a, "/");
+}
+
+lval* builtin_mod(lenv* e, lval* a) {
+    return builtin_op(e, a, "%");
+}
+
+/* Inline caches of call sites whose head is a global variable holding a
+ * function. A site uses the entry its number maps to, which is valid for
+ * as long as the site owns it and the variable keeps the same version.
+ * Hits call the builtin without evaluating the head at all */
+#define LCALL_CACHE_SIZE 1024
+
+typedef struct lcall_cache {
+    unsigned int site;
+    unsigned int version;
+    lenv_cell* cell;
+    lbuiltin fun;
+} lcall_cache;
+
+lcall_cache lcall_caches[LCALL_CACHE_SIZE];
+long lcall_hits = 0;
+long lcall_misses = 0;
+
+/* The builtin a call site with head symbol a calls, NULL if a isn't bound
+ * to a function and the head has to be evaluated as usual */
+lbuiltin lcall_lookup(lval* v, latom* a) {
+    lenv_cell* c = a->global;
+    if (c == NULL) { return NULL; }
+
+    lcall_cache* ic = &lcall_caches[v->site & (LCALL_CACHE_SIZE - 1)];
+    if (v->site && ic->site == v->site && ic->cell == c && ic->version == c->version) {
+        lcall_hits++;
+        return ic->fun;
+    }
+
+    lcall_misses++;
+    if (c->val == NULL || LVAL_TYPE(c->val) != LVAL_FUN) { return NULL; }
+    if (v->site) {
+        ic->site = v->site;
+        ic->version = c->version;
+        ic->cell = c;
+        ic->fun = c->val->fun;
+    }
+    return c->val->fun;
+}
+
+// Forward definition
+lval* lval_eval_sexpr(lval* v, lenv* e, lval** tail);
+lval* builtin_eval(lenv* e, lval* a);
+int lbuiltin_nullary(lbuiltin fun);
+
+/* Whether v is a builtin called by a list holding nothing else. Any other
+ * value alone in a list is what the list evaluates to */
+int lval_nullary(lval* v) {
+    return LVAL_TYPE(v) == LVAL_FUN && lbuiltin_nullary(v->fun);
+}
+
+/* Own flat copy of a Q-Expression to evaluate as an S-Expression */
+lval* lval_eval_source(lval* q) {
+    lval* v = lval_unshare(lvec_flatten(q));
+    v->type = LVAL_SEXPR;
+    return v;
+}
+
+lval* lval_eval(lenv* e, lval* v) {
+    int roots = gc_root_count;
+
+    // A call of eval comes back around this loop with the list it
+    // evaluates rather than recursing, so tail calls take no C stack
+    for (;;) {
+        GC_ROOT(v);
+        gc_safepoint(e);
+        int over = lmem_over_limit(e);
+        gc_root_count = roots;
+
+        // Abandon a runaway evaluation, each step unwinds with an error
+        if (over) {
+            lval_del(v);
+            return lval_err(LERR_MEM_LIMIT, lmem_limit);
+        }
+
+        // Load symbol from it's cell and delete
+        if (LVAL_TYPE(v) == LVAL_SYM) {
+            lval* x = lenv_get(e, v);
+            lval_del(v);
+            return x;
+        }
+        // Evaluate S-Expressions, dropping whatever roots they pushed
+        if (LVAL_TYPE(v) == LVAL_SEXPR) {
+            lval* tail = NULL;
+            lval* x = lval_eval_sexpr(lval_unshare(v), e, &tail);
+            gc_root_count = roots;
+            if (tail == NULL) { return x; }
+            v = lval_eval_source(tail);
+            continue;
+        }
+        return v;
+    }
+}
+
+/* Builtin called by the list v when it's head is a global function, found
+ * through the inline cache, so the head symbol needn't be evaluated */
+lbuiltin lval_eval_head(lval* v) {
+    if (v->count > 0 && LVAL_TYPE(v->cell[0]) == LVAL_SYM) {
+        return lcall_lookup(v, LVAL_ATOM(v->cell[0]));
+    }
+    return NULL;
+}
+
+/* Strategy of the arguments after the first once x is evaluated at i */
+int lval_eval_strategy(int strategy, int i, lval* x) {
+    if (i == 1) { return lval_strategy_of(x); }
+    if (i > 1 && strategy != lval_strategy_of(x)) { return LVAL_LIST_ANY; }
+    return strategy;
+}
+
+/* Apply an S-Expression whose elements have been evaluated, fun being the
+ * builtin from lval_eval_head if there was one. A valid call of eval isn't
+ * made here: the Q-Expression to evaluate is left in tail for the caller
+ * instead. Pushes roots the caller drops */
+lval* lval_eval_apply(lenv* e, lval* v, lbuiltin fun, int strategy, lval** tail) {
+    lval* f = NULL;
+    GC_ROOT(v);
+    GC_ROOT(f);
+
+    // Error checking
+    for (int i = 0; i < v->count; i++) {
+        if (LVAL_TYPE(v->cell[i]) == LVAL_ERR) { return lval_take(v, i); }
+    }
+
+    // Empty expressions
+    if (v->count == 0) { return v; }
+
+    if (fun) {
+        // A function on it's own is it's value
+        if (v->count == 1 && !lbuiltin_nullary(fun)) {
+            lval* x = lenv_get(e, v->cell[0]);
+            lval_del(v);
+            return x;
+        }
+        lval_del(lval_pop(v, 0));
+        v->strategy = strategy;
+        if (fun == builtin_eval && v->count == 1 && LVAL_TYPE(v->cell[0]) == LVAL_QEXPR) {
+            *tail = lval_take(v, 0);
+            return NULL;
+        }
+        return fun(e, v);
+    }
+
+    // Single expression, unless it's a builtin to call without arguments
+    if (v->count == 1 && !lval_nullary(v->cell[0])) { return lval_take(v, 0); }
+
+    // Ensure first element is a function
+    f = lval_pop(v, 0);
+    v->strategy = strategy;
+    if (LVAL_TYPE(f) != LVAL_FUN) {
+        lval_del(v);
+        lval_del(f);
+        return lval_err(LERR_NOT_FUNCTION);
+    }
+
+    if (f->fun == builtin_eval && v->count == 1 && LVAL_TYPE(v->cell[0]) == LVAL_QEXPR) {
+        lval_del(f);
+        *tail = lval_take(v, 0);
+        return NULL;
+    }
+
+    lval* result = f->fun(e, v);
+    lval_del(f);
+    return result;
+}
+
+/* Evaluate an S-Expression, recursing on it's elements. Leaves a valid
+ * call of eval in tail for the caller, as lval_eval_apply does */
+lval* lval_eval_sexpr(lval* v, lenv* e, lval** tail) {
+    GC_ROOT(v);
+
+    // Calls of global functions leave the head symbol alone
+    lbuiltin fun = lval_eval_head(v);
+
+    // Evaluate children, noting the strategy of the arguments after the
+    // first so builtins can skip checking their types
+    int strategy = LVAL_LIST_ANY;
+    for (int i = fun ? 1 : 0; i < v->count; i++) {
+        lval* x = lval_eval(e, v->cell[i]);
+        v->cell[i] = x;
+        gc_write_barrier(v, x);
+        strategy = lval_eval_strategy(strategy, i, x);
+    }
+
+    return lval_eval_apply(e, v, fun, strategy, tail);
+}
+
+// Forward definition
+int lbuiltin_find(char* name);
+
+/* Bytecode compiler. Code is compiled from S-Expressions once and
+ * can then be run any number of times without touching the source, which
+ * the tree-walker has to copy and take apart on every evaluation */
+lcode* lcode_new(void) {
+    lcode* c = lmem_alloc(LMEM_CODE, sizeof(lcode));
+    c->count = 0;
+    c->cap = 16;
+    c->words = lmem_alloc(LMEM_CODE, sizeof(lword) * c->cap);
+    c->stack = 0;
+    c->consts = lval_qexpr();
+    c->src = NULL;
+    c->refs = 1;
+    c->threaded = 0;
+    c->jit = LJIT_COLD;
+    c->runs = 0;
+    c->bailouts = 0;
+    c->native = NULL;
+    c->native_size = 0;
+    c->prev = NULL;
+    c->next = lcode_live;
+    if (lcode_live) { lcode_live->prev = c; }
+    lcode_live = c;
+    return c;
+}
+
+void ljit_free(lcode* c);
+
+/* Drop a reference to code, freeing it with the last one */
+void lcode_release(lcode* c) {
+    if (--c->refs > 0) { return; }
+    ljit_free(c);
+    if (c->prev) { c->prev->next = c->next; } else { lcode_live = c->next; }
+    if (c->next) { c->next->prev = c->prev; }
+    lval_del(c->consts);
+    if (c->src) { lval_del(c->src); }
+    lmem_free(LMEM_CODE, c->words, sizeof(lword) * c->cap);
+    lmem_free(LMEM_CODE, c, sizeof(lcode));
+}
+
+lword* lcode_emit(lcode* c, int n) {
+    if (c->count + n > c->cap) {
+        c->words = lmem_realloc(LMEM_CODE, c->words, sizeof(lword) * c->cap, sizeof(lword) * c->cap * 2);
+        c->cap *= 2;
+    }
+    c->count += n;
+    return &c->words[c->count - n];
+}
+
+/* Note the stack reaching depth values */
+void lcode_depth(lcode* c, int depth) {
+    if (depth > c->stack) { c->stack = depth; }
+}
+
+void lcode_const(lcode* c, lval* x, int depth) {
+    lword* w = lcode_emit(c, 2);
+    w[0].i = LOP_CONST;
+    w[1].i = c->consts->count;
+    lval_add(c->consts, x);
+    lcode_depth(c, depth + 1);
+}
+
+void lcode_list(lenv* e, lcode* c, lval* v, int depth);
+
+/* Compile code pushing the value of v, with depth values already on the
+ * stack */
+void lcode_expr(lenv* e, lcode* c, lval* v, int depth) {
+    switch (LVAL_TYPE(v)) {
+        case LVAL_SYM: {
+            // Cells never move, so a bound symbol is loaded from it's cell
+            lenv_cell* cell = lenv_lookup(e, LVAL_ATOM(v));
+            lword* w = lcode_emit(c, 2);
+            w[0].i = cell ? LOP_GLOBAL : LOP_LOOKUP;
+            w[1].p = cell ? (void*)cell : (void*)LVAL_ATOM(v);
+            lcode_depth(c, depth + 1);
+            break;
+        }
+        case LVAL_SEXPR: lcode_list(e, c, v, depth); break;
+        default: lcode_const(c, lval_retain(v), depth); break;
+    }
+}
+
+/* Compile a flat list evaluated as an S-Expression */
+void lcode_list(lenv* e, lcode* c, lval* v, int depth) {
+    if (v->count == 0) {
+        lcode_const(c, lval_sexpr(), depth);
+        return;
+    }
+    if (v->count == 1) {
+        lcode_expr(e, c, v->cell[0], depth);
+        lcode_emit(c, 1)->i = LOP_SINGLE;
+        return;
+    }
+
+    // Builtin names can't be redefined, so arithmetic on them is compiled
+    // straight to LOP_ARITH without a function value or argument list
+    int id = LVAL_TYPE(v->cell[0]) == LVAL_SYM ? lbuiltin_find(LVAL_ATOM(v->cell[0])->name) : -1;
+    if (id == LBUILTIN_ADD || id == LBUILTIN_SUB || id == LBUILTIN_MUL || id == LBUILTIN_DIV || id == LBUILTIN_MOD) {
+        for (int i = 1; i < v->count; i++) { lcode_expr(e, c, v->cell[i], depth + i - 1); }
+        lword* w = lcode_emit(c, 3);
+        w[0].i = LOP_ARITH;
+        w[1].p = LVAL_ATOM(v->cell[0])->name;
+        w[2].i = v->count - 1;
+        return;
+    }
+
+    for (int i = 0; i < v->count; i++) { lcode_expr(e, c, v->cell[i], depth + i); }
+    lword* w = lcode_emit(c, 2);
+    w[0].i = LOP_CALL;
+    w[1].i = v->count - 1;
+}
+
+/* Compile a list to be evaluated as an S-Expression */
+lcode* lcode_compile(lenv* e, lval* v) {
+    lcode* c = lcode_new();
+
+    // eval with one argument is in tail position here, so it ends the code
+    int id = v->count == 2 && LVAL_TYPE(v->cell[0]) == LVAL_SYM ? lbuiltin_find(LVAL_ATOM(v->cell[0])->name) : -1;
+    if (id == LBUILTIN_EVAL) {
+        lcode_expr(e, c, v->cell[1], 0);
+        lcode_emit(c, 1)->i = LOP_EVAL;
+        return c;
+    }
+
+    lcode_list(e, c, v, 0);
+    lcode_emit(c, 1)->i = LOP_END;
+    return c;
+}
+
+/* Code compiled for eval, looked up by the Q-Expression it came from.
+ * The cache holds a reference to it, so it is shared and can't be changed
+ * in place while the code is cached. It doesn't keep the list alive
+ * though: an entry goes once nothing else owns it's list, when reference
+ * counts or the collector show that. A list is only compiled the second
+ * time it is evaluated, and the cache holds at most LCODE_CACHE_BYTES */
+#define LCODE_CACHE_SIZE 256
+#define LCODE_CACHE_BYTES (64 << 20)
+
+lcode* lcode_cache[LCODE_CACHE_SIZE];
+/* Address of the last list each slot saw evaluated without code. A list
+ * is forgotten when it's freed, so another reusing the address is only
+ * compiled once it is evaluated twice itself */
+uintptr_t lcode_seen[LCODE_CACHE_SIZE];
+
+void lcode_unseen(lval* v) {
+    int i = ((uintptr_t)v >> 5) & (LCODE_CACHE_SIZE - 1);
+    if (lcode_seen[i] == (uintptr_t)v) { lcode_seen[i] = 0; }
+}
+
+/* Memory held by a code */
+long lcode_bytes(lcode* c) {
+    return sizeof(lcode) + sizeof(lword) * c->cap + sizeof(lval*) * c->consts->cap + c->native_size;
+}
+
+void lcode_cache_drop(int i) {
+    lcode_release(lcode_cache[i]);
+    lcode_cache[i] = NULL;
+}
+
+/* Evict cached code until the cache is within it's budget. Codes being
+ * run and keep go last, they are only put off until they finish */
+void lcode_cache_fit(lcode* keep) {
+    long bytes = 0;
+    for (int i = 0; i < LCODE_CACHE_SIZE; i++) {
+        if (lcode_cache[i]) { bytes += lcode_bytes(lcode_cache[i]); }
+    }
+    for (int pass = 0; pass < 2; pass++) {
+        for (int i = 0; i < LCODE_CACHE_SIZE && bytes > LCODE_CACHE_BYTES; i++) {
+            lcode* c = lcode_cache[i];
+            if (c && (pass == 1 || (c != keep && c->refs == 1))) {
+                bytes -= lcode_bytes(c);
+                lcode_cache_drop(i);
+            }
+        }
+    }
+}
+
+/* Code for the Q-Expression v, compiled if it is evaluated again and
+ * isn't cached. Trees are looked up as they are, so a vector isn't
+ * flattened again on a hit. The caller gets a reference to the code, or
+ * NULL the first time, when v is better interpreted than compiled */
+lcode* lcode_cached(lenv* e, lval* v) {
+    int i = ((uintptr_t)v >> 5) & (LCODE_CACHE_SIZE - 1);
+    lcode** slot = &lcode_cache[i];
+    if (*slot && (*slot)->src == v) {
+        (*slot)->refs++;
+        return *slot;
+    }
+    if (lcode_seen[i] != (uintptr_t)v) {
+        lcode_seen[i] = (uintptr_t)v;
+        return NULL;
+    }
+
+    if (*slot) { lcode_cache_drop(i); }
+    lval* flat = lvec_flatten(lval_retain(v));
+    lcode* c = lcode_compile(e, flat);
+    lval_del(flat);
+
+    // Cached code may live a while, so give back the slack
+    c->words = lmem_realloc(LMEM_CODE, c->words, sizeof(lword) * c->cap, sizeof(lword) * c->count);
+    c->cap = c->count;
+
+    // Code for a promoted list can outlive the arena, so it's constants
+    // are promoted with it
+    if (lmm == LMM_ARENA && !(v->mark & GC_ARENA)) {
+        lval* consts = gc_promote(c->consts);
+        lval_del(c->consts);
+        c->consts = consts;
+    }
+    c->src = lval_retain(v);
+    c->refs++;
+    *slot = c;
+    lcode_cache_fit(c);
+    return c;
+}
+
+/* Drop the cached code for lists in the arena before it is reset */
+void lcode_cache_arena_reset(void) {
+    for (int i = 0; i < LCODE_CACHE_SIZE; i++) {
+        if (lcode_cache[i] && (lcode_cache[i]->src->mark & GC_ARENA)) { lcode_cache_drop(i); }
+    }
+}
+
+/* Drop the cached code for lists only the cache still has a reference
+ * to, where values are reference counted */
+void lcode_cache_trim(void) {
+    for (int i = 0; i < LCODE_CACHE_SIZE; i++) {
+        lval* src = lcode_cache[i] ? lcode_cache[i]->src : NULL;
+        if (src && LVAL_COUNTED(src) && src->refs == 1) { lcode_cache_drop(i); }
+    }
+}
 
-        if (x->type == LVAL_LINT) {
-            if (strcmp(op, "+") == 0) { x->lint += y->lint; }
-            if (strcmp(op, "-") == 0) { x->lint -= y->lint; }
-            if (strcmp(op, "*") == 0) { x->lint *= y->lint; }
-            if (strcmp(op, "/") == 0) { 
-                if (y->lint == 0) {
-                   lval_del(x);
-                   lval_del(y);
-                   x = lval_err("Division by zero");
-                   break; 
-                }
-                x->lint /= y->lint;
-            }
-            if (strcmp(op, "%") == 0) { 
-                if (y->lint == 0) {
-                   lval_del(x);
-                   lval_del(y);
-                   x = lval_err("Division by zero");
-                   break; 
-                }
-                x->lint %= y->lint;
-            }
-            lval_del(y);
-        }
-
-        if (x->type == LVAL_DEC) {
-            if (strcmp(op, "+") == 0) { x->dec += y->dec; }
-            if (strcmp(op, "-") == 0) { x->dec -= y->dec; }
-            if (strcmp(op, "*") == 0) { x->dec *= y->dec; }
-            if (strcmp(op, "/") == 0) { 
-                if (y->dec == 0) {
-                   lval_del(x);
-                   lval_del(y);
-                   x = lval_err("Division by zero");
-                   break; 
-                }
-                x->dec /= y->dec;
-            }
-            if (strcmp(op, "%") == 0) { 
-                if (y->dec == 0) {
-                   lval_del(x);
-                   lval_del(y);
-                   x = lval_err("Division by zero");
-                   break; 
-                }
-                x->dec = fmod(x->dec, y->dec);
-            }
-            lval_del(y);
+/* Forget the lists the collector's marking didn't reach, which it is
+ * about to sweep, and drop their cached code */
+void lcode_cache_forget(void) {
+    for (lcode* c = lcode_live; c != NULL; c = c->next) {
+        if (c->src && !gc_reached(c->src)) { c->src = NULL; }
+    }
+    for (int i = 0; i < LCODE_CACHE_SIZE; i++) {
+        if (lcode_cache[i] && lcode_cache[i]->src == NULL) { lcode_cache_drop(i); }
+    }
+}
+
+/* Drop every cached code, for an evaluation up against the memory limit */
+void lcode_cache_flush(void) {
+    for (int i = 0; i < LCODE_CACHE_SIZE; i++) {
+        if (lcode_cache[i]) { lcode_cache_drop(i); }
+    }
+}
+
+/* Release count values on the VM stack */
+void lvm_drop(lval** v, int count) {
+    for (int i = 0; i < count; i++) {
+        if (v[i]) { lval_del(v[i]); }
+        v[i] = NULL;
+    }
+}
+
+/* First error among count values on the VM stack, releasing the rest */
+lval* lvm_error(lval** v, int count) {
+    for (int i = 0; i < count; i++) {
+        if (LVAL_TYPE(v[i]) == LVAL_ERR) {
+            lval* x = v[i];
+            v[i] = NULL;
+            lvm_drop(v, count);
+            return x;
         }
     }
-    lval_del(a);
+    return NULL;
+}
+
+/* Evaluate the S-Expression whose count values are on the VM stack,
+ * with the same rules as lval_eval_sexpr. Consumes the values */
+lval* lvm_apply(lenv* e, lval** v, int count) {
+    lval* x = lvm_error(v, count);
+    if (x) { return x; }
+
+    lval* f = v[0];
+    if (count == 1 && !lval_nullary(f)) {
+        v[0] = NULL;
+        return f;
+    }
+    if (LVAL_TYPE(f) != LVAL_FUN) {
+        lvm_drop(v, count);
+        return lval_err(LERR_NOT_FUNCTION);
+    }
+
+    // Move the arguments into the list the builtin consumes, it stays
+    // rooted in the function's slot while the builtin runs
+    lval* a = lval_sexpr();
+    if (count > 1) {
+        a->cell = lmem_alloc(LMEM_CELLS, sizeof(lval*) * (count - 1));
+        a->cap = count - 1;
+    }
+    for (int i = 1; i < count; i++) {
+        lval_add(a, v[i]);
+        v[i] = NULL;
+    }
+    lbuiltin fun = f->fun;
+    lval_del(f);
+    v[0] = a;
+    x = fun(e, a);
+    v[0] = NULL;
     return x;
 }
 
-/* Builtin operators */
-lval* builtin_add(lenv* e, lval* a) {
-    return builtin_op(e, a, "+");
+/* Collect garbage if due, and report whether the memory limit is blown */
+int lvm_safepoint(lenv* e) {
+    gc_safepoint(e);
+    return lmem_over_limit(e);
 }
 
-lval* builtin_sub(lenv* e, lval* a) {
-    return builtin_op(e, a, "-");
+/* Handler addresses threaded code is made of, once the VM has run */
+void** lvm_handlers = NULL;
+
+/* Replace the opcodes in c with the addresses of their handlers */
+void lvm_thread(lcode* c, void** handlers) {
+    lvm_handlers = handlers;
+    for (int i = 0; i < c->count; ) {
+        long op = c->words[i].i;
+        c->words[i].p = handlers[op];
+        i += lop_words[op];
+    }
+    c->threaded = 1;
 }
 
-lval* builtin_mul(lenv* e, lval* a) {
-    return builtin_op(e, a, "*");
+/* Opcode of the instruction at word i, threaded or not */
+long lcode_op(lcode* c, int i) {
+    if (!c->threaded) { return c->words[i].i; }
+    for (int op = 0; op < LOP_COUNT; op++) {
+        if (c->words[i].p == lvm_handlers[op]) { return op; }
+    }
+    return -1;
 }
 
-lval* builtin_div(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+/* Template JIT. Code that has been run LJIT_THRESHOLD times and is made
+ * only of integer constants, global variables and arithmetic builtins is
+ * translated instruction by instruction into x86-64 code, which works on
+ * untagged longs in a scratch array laid out like the VM stack. The code
+ * goes into mmap'd pages that are made executable once written.
+ *
+ * Globals are guarded to hold fixnums and divisors not to be 0 or -1. A
+ * failed guard bails out to the VM, which runs the code from the start
+ * and gets the same answer or error as it always would: the native code
+ * only reads, so there's nothing to undo. Code that keeps bailing out is
+ * left to the VM for good. --jit=off turns the JIT off, -DLILSP_NO_JIT
+ * leaves it out of the build */
+#define LJIT_THRESHOLD 2
+#define LJIT_MAX_BAILOUTS 8
+/* Code starts with the bail out stub, the entry point follows it */
+#define LJIT_ENTRY 6
+
+int ljit_on = LJIT;
+
+struct {
+    long compiled;
+    long rejected;
+    long runs;
+    long bailouts;
+    long bytes;
+} ljit_counters;
+
+/* Machine code being put together */
+typedef struct ljit_buf {
+    unsigned char* b;
+    int n;
+    int cap;
+} ljit_buf;
+
+void ljit_emit(ljit_buf* j, const char* bytes, int n) {
+    if (j->n + n > j->cap) {
+        j->cap = (j->cap + n) * 2;
+        j->b = realloc(j->b, j->cap);
+    }
+    memcpy(j->b + j->n, bytes, n);
+    j->n += n;
 }
 
-lval* builtin_mod(lenv* e, lval* a) {
-    return builtin_op(e, a, "/");
+void ljit_emit32(ljit_buf* j, int32_t x) { ljit_emit(j, (char*)&x, 4); }
+void ljit_emit64(ljit_buf* j, int64_t x) { ljit_emit(j, (char*)&x, 8); }
+
+/* Instruction with a [rdi + 8 * slot] operand */
+void ljit_emit_slot(ljit_buf* j, const char* op, int n, int slot) {
+    ljit_emit(j, op, n);
+    ljit_emit32(j, slot * 8);
 }
 
-// Forward definition
-lval* lval_eval_sexpr(lval* v, lenv* e);
+/* jcc rel32 back to the bail out stub at the start of the code */
+void ljit_emit_bail(ljit_buf* j, const char* jcc) {
+    ljit_emit(j, jcc, 2);
+    ljit_emit32(j, -(j->n + 4));
+}
 
-lval* lval_eval(lenv* e, lval* v) {
-    // Get symbol and delete
-    if (v->type == LVAL_SYM) {
-        lval* x = lenv_get(e, v);
-        lval_del(v);
-        return x;
+/* Whether every instruction of c is one the JIT has a template for */
+int ljit_supported(lcode* c) {
+    int arith = 0;
+    for (int i = 0; i < c->count; i += lop_words[lcode_op(c, i)]) {
+        switch (lcode_op(c, i)) {
+            case LOP_CONST:
+                if (LVAL_TYPE(c->consts->cell[c->words[i + 1].i]) != LVAL_LINT) { return 0; }
+                break;
+            case LOP_ARITH: arith++; break;
+            case LOP_GLOBAL:
+            case LOP_SINGLE:
+            case LOP_END: break;
+            default: return 0;
+        }
     }
-    // Evaluate S-Expressions
-    if (v->type == LVAL_SEXPR) { return lval_eval_sexpr(v, e); }
-    return v;
+    return arith > 0;
 }
 
-lval* lval_eval_sexpr(lval* v, lenv* e) {
-    // Evaluate children
-    for (int i = 0; i < v->count; i++) {
-        v->cell[i] = lval_eval(e, v->cell[i]);
+/* Translate c to native code, false if it can't be */
+int ljit_compile(lcode* c) {
+#if LJIT
+    if (!ljit_supported(c)) { return 0; }
+
+    // Bail out stub: return 1
+    ljit_buf j = { NULL, 0, 0 };
+    ljit_emit(&j, "\xb8\x01\x00\x00\x00\xc3", LJIT_ENTRY);
+
+    int sp = 0;
+    for (int i = 0; i < c->count; i += lop_words[lcode_op(c, i)]) {
+        lword* w = &c->words[i];
+        switch (lcode_op(c, i)) {
+            case LOP_CONST:
+                // mov rax, imm64; mov [slot], rax
+                ljit_emit(&j, "\x48\xb8", 2);
+                ljit_emit64(&j, LVAL_LINT_VAL(c->consts->cell[w[1].i]));
+                ljit_emit_slot(&j, "\x48\x89\x87", 3, sp++);
+                break;
+
+            case LOP_GLOBAL:
+                // mov rax, &cell->val; mov rax, [rax]; test al, 1; jz bail;
+                // sar rax, 1; mov [slot], rax
+                ljit_emit(&j, "\x48\xb8", 2);
+                ljit_emit64(&j, (int64_t)(uintptr_t)&((lenv_cell*)w[1].p)->val);
+                ljit_emit(&j, "\x48\x8b\x00\xa8\x01", 5);
+                ljit_emit_bail(&j, "\x0f\x84");
+                ljit_emit(&j, "\x48\xd1\xf8", 3);
+                ljit_emit_slot(&j, "\x48\x89\x87", 3, sp++);
+                break;
+
+            case LOP_SINGLE:
+                // A number on it's own evaluates to itself
+                break;
+
+            case LOP_ARITH: {
+                char op = ((char*)w[1].p)[0];
+                int n = w[2].i;
+                int base = sp - n;
+                // mov rax, [base]
+                ljit_emit_slot(&j, "\x48\x8b\x87", 3, base);
+                if (op == '-' && n == 1) { ljit_emit(&j, "\x48\xf7\xd8", 3); }
+                for (int k = base + 1; k < sp; k++) {
+                    switch (op) {
+                        case '+': ljit_emit_slot(&j, "\x48\x03\x87", 3, k); break;
+                        case '-': ljit_emit_slot(&j, "\x48\x2b\x87", 3, k); break;
+                        case '*': ljit_emit_slot(&j, "\x48\x0f\xaf\x87", 4, k); break;
+                        case '/':
+                        case '%':
+                            // mov rcx, [slot]; test rcx, rcx; jz bail;
+                            // cmp rcx, -1; je bail; cqo; idiv rcx
+                            ljit_emit_slot(&j, "\x48\x8b\x8f", 3, k);
+                            ljit_emit(&j, "\x48\x85\xc9", 3);
+                            ljit_emit_bail(&j, "\x0f\x84");
+                            ljit_emit(&j, "\x48\x83\xf9\xff", 4);
+                            ljit_emit_bail(&j, "\x0f\x84");
+                            ljit_emit(&j, "\x48\x99\x48\xf7\xf9", 5);
+                            // The remainder is in rdx
+                            if (op == '%') { ljit_emit(&j, "\x48\x89\xd0", 3); }
+                            break;
+                    }
+                }
+                // mov [base], rax
+                ljit_emit_slot(&j, "\x48\x89\x87", 3, base);
+                sp = base + 1;
+                break;
+            }
+
+            case LOP_END:
+                // mov rax, [0]; mov [rsi], rax; xor eax, eax; ret
+                ljit_emit_slot(&j, "\x48\x8b\x87", 3, 0);
+                ljit_emit(&j, "\x48\x89\x06\x31\xc0\xc3", 6);
+                break;
+        }
     }
 
-    // Error checking
-    for (int i = 0; i < v->count; i++) {
-        if (v->cell[i]->type == LVAL_ERR) { return lval_take(v, i); }
+    // Write the code, then make it executable and read only
+    void* p = mmap(NULL, j.n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        free(j.b);
+        return 0;
+    }
+    memcpy(p, j.b, j.n);
+    free(j.b);
+    if (mprotect(p, j.n, PROT_READ | PROT_EXEC) != 0) {
+        munmap(p, j.n);
+        return 0;
     }
 
-    // Empty expressions
-    if (v->count == 0) { return v; }
+    c->native = p;
+    c->native_size = j.n;
+    lmem_note(LMEM_CODE, j.n);
+    ljit_counters.bytes += j.n;
+    return 1;
+#else
+    return 0;
+#endif
+}
 
-    // Single expression
-    if (v->count == 1) { return lval_take(v, 0); }
+/* Give back the native code of c, if it has any */
+void ljit_free(lcode* c) {
+#if LJIT
+    if (c->native == NULL) { return; }
+    munmap(c->native, c->native_size);
+    lmem_note(LMEM_CODE, -(long)c->native_size);
+    ljit_counters.bytes -= c->native_size;
+    c->native = NULL;
+#endif
+}
 
-    // Ensure first element is a function
-    lval* f = lval_pop(v, 0);
-    if (f->type != LVAL_FUN) {
-        lval_del(v);
-        lval_del(f);
-        return lval_err("First element is not a function.");
+/* Run c natively if it has been compiled, compiling it once it has run
+ * often enough. NULL when the VM has to run it instead */
+lval* ljit_run(lenv* e, lcode* c) {
+    if (!ljit_on || c->jit == LJIT_NEVER) { return NULL; }
+    if (c->jit == LJIT_COLD) {
+        if (++c->runs < LJIT_THRESHOLD) { return NULL; }
+        if (!ljit_compile(c)) {
+            c->jit = LJIT_NEVER;
+            ljit_counters.rejected++;
+            return NULL;
+        }
+        c->jit = LJIT_NATIVE;
+        ljit_counters.compiled++;
+        // The native code is counted against the eval cache too
+        if (c->src) { lcode_cache_fit(c); }
     }
 
-    lval* result = f->fun(e, v);
-    lval_del(f);
-    return result;
+    // The VM checks the memory limit before any arithmetic
+    if (lvm_safepoint(e)) { return NULL; }
+
+    long x;
+    long small[64];
+    long* slots = c->stack <= 64 ? small : lmem_alloc(LMEM_STACK, sizeof(long) * c->stack);
+    int bailed = ((ljit_fn)(c->native + LJIT_ENTRY))(slots, &x);
+    if (slots != small) { lmem_free(LMEM_STACK, slots, sizeof(long) * c->stack); }
+
+    if (bailed) {
+        ljit_counters.bailouts++;
+        if (++c->bailouts == LJIT_MAX_BAILOUTS) {
+            ljit_free(c);
+            c->jit = LJIT_NEVER;
+        }
+        return NULL;
+    }
+    ljit_counters.runs++;
+    return lval_lint(x);
+}
+
+#if LVM_THREADED
+#define LVM_OP(op) op_##op:
+#define LVM_NEXT() goto *pc->p
+#else
+#define LVM_OP(op) case op:
+#define LVM_NEXT() continue
+#endif
+
+/* A VM stack of size empty slots, each a collector root */
+lval** lvm_stack(int size) {
+    lval** stack = lmem_alloc(LMEM_STACK, sizeof(lval*) * size);
+    for (int i = 0; i < size; i++) {
+        stack[i] = NULL;
+        GC_ROOT(stack[i]);
+    }
+    return stack;
+}
+
+/* Run code, returning the value it leaves on the stack */
+lval* lvm_run(lenv* e, lcode* c) {
+    lval* native = ljit_run(e, c);
+    if (native != NULL) { return native; }
+
+    int roots = gc_root_count;
+    int size = c->stack;
+    lval** stack = lvm_stack(size);
+    c->refs++;
+
+    int sp = 0;
+    int over = 0;
+    lword* pc = c->words;
+
+#if LVM_THREADED
+    static void* handlers[LOP_COUNT] = {
+        &&op_LOP_CONST, &&op_LOP_GLOBAL, &&op_LOP_LOOKUP, &&op_LOP_SINGLE, &&op_LOP_CALL,
+        &&op_LOP_ARITH, &&op_LOP_EVAL, &&op_LOP_END
+    };
+    if (!c->threaded) { lvm_thread(c, handlers); }
+    LVM_NEXT();
+#else
+    for (;;) switch (pc->i) {
+#endif
+
+    LVM_OP(LOP_CONST)
+        stack[sp++] = lval_retain(c->consts->cell[pc[1].i]);
+        pc += 2;
+        LVM_NEXT();
+
+    LVM_OP(LOP_GLOBAL) {
+        lenv_cell* cell = pc[1].p;
+        stack[sp++] = cell->val ? lval_retain(cell->val) : lval_err(LERR_UNBOUND, cell->sym->name);
+        pc += 2;
+        LVM_NEXT();
+    }
+
+    LVM_OP(LOP_LOOKUP) {
+        latom* a = pc[1].p;
+        lenv_cell* cell = lenv_lookup(e, a);
+        stack[sp++] = cell && cell->val ? lval_retain(cell->val) : lval_err(LERR_UNBOUND, a->name);
+        pc += 2;
+        LVM_NEXT();
+    }
+
+    LVM_OP(LOP_SINGLE)
+        if ((over = lvm_safepoint(e))) { goto done; }
+        stack[sp - 1] = lvm_apply(e, &stack[sp - 1], 1);
+        pc += 1;
+        LVM_NEXT();
+
+    LVM_OP(LOP_CALL) {
+        if ((over = lvm_safepoint(e))) { goto done; }
+        int n = pc[1].i + 1;
+        sp -= n;
+        stack[sp] = lvm_apply(e, &stack[sp], n);
+        sp++;
+        pc += 2;
+        LVM_NEXT();
+    }
+
+    LVM_OP(LOP_ARITH) {
+        if ((over = lvm_safepoint(e))) { goto done; }
+        int n = pc[2].i;
+        sp -= n;
+        lval* x = lvm_error(&stack[sp], n);
+        if (x == NULL) {
+            x = lval_arith(pc[1].p, &stack[sp], n, LVAL_LIST_ANY);
+            lvm_drop(&stack[sp], n);
+        }
+        stack[sp++] = x;
+        pc += 3;
+        LVM_NEXT();
+    }
+
+    LVM_OP(LOP_EVAL) {
+        if ((over = lvm_safepoint(e))) { goto done; }
+        lval* q = stack[0];
+        int type = LVAL_TYPE(q);
+        if (type != LVAL_QEXPR) {
+            if (type != LVAL_ERR) {
+                lval_del(q);
+                stack[0] = lval_err(LERR_ARG_TYPE, "eval", 1, type, LVAL_QEXPR);
+            }
+            goto done;
+        }
+
+        // Switch to the list's code, keeping this stack unless it's too small
+        stack[0] = NULL;
+        sp = 0;
+        lcode* next = lcode_cached(e, q);
+        if (next == NULL) {
+            // Not worth compiling yet, the tree-walker takes it's own tail
+            // calls without recursing
+            stack[sp++] = lval_eval(e, lval_eval_source(q));
+            goto done;
+        }
+        lval_del(q);
+        lcode_release(c);
+        c = next;
+        if (c->stack > size) {
+            gc_root_count = roots;
+            lmem_free(LMEM_STACK, stack, sizeof(lval*) * size);
+            size = c->stack;
+            stack = lvm_stack(size);
+        }
+        lval* native = ljit_run(e, c);
+        if (native != NULL) {
+            stack[sp++] = native;
+            goto done;
+        }
+        pc = c->words;
+#if LVM_THREADED
+        if (!c->threaded) { lvm_thread(c, handlers); }
+#endif
+        LVM_NEXT();
+    }
+
+    LVM_OP(LOP_END)
+        goto done;
+
+#if !LVM_THREADED
+    }
+#endif
+
+done:;
+    lval* x = stack[0];
+    if (over) {
+        // Abandon a runaway evaluation, as lval_eval does
+        lvm_drop(stack, sp);
+        x = lval_err(LERR_MEM_LIMIT, lmem_limit);
+    }
+    gc_root_count = roots;
+    lmem_free(LMEM_STACK, stack, sizeof(lval*) * size);
+    lcode_release(c);
+    return x;
+}
+
+/* Evaluate a Q-Expression as an S-Expression on the VM, consumes v */
+lval* lvm_eval(lenv* e, lval* v) {
+    // A list is interpreted the first time, only code run again is
+    // worth compiling
+    lcode* c = lcode_cached(e, v);
+    if (c == NULL) { return lval_eval(e, lval_eval_source(v)); }
+    lval_del(v);
+    lval* x = lvm_run(e, c);
+    lcode_release(c);
+    return x;
+}
+
+/* Explicit stack evaluator, --eval=cek. It follows the tree-walker's
+ * rules, but each S-Expression being evaluated is a frame on a heap stack
+ * rather than a C call, so nesting is only limited by memory. The control
+ * is the value being evaluated and the frames are the continuation, each
+ * waiting for the value of it's element i. Calls of eval replace their
+ * frame, so they take no stack at all */
+typedef struct lcek_frame {
+    lval* v;
+    int i;
+    int strategy;
+    lbuiltin fun;
+} lcek_frame;
+
+/* Stack statistics for stack-stats. The depth is counted across nested
+ * runs of the machine */
+struct {
+    long depth;
+    long peak;
+    long frames;
+    long tail_calls;
+    long steps;
+} lcek_counters;
+
+/* Runs of the machine in progress, innermost first, so stack-frames can
+ * find their frames */
+typedef struct lcek_run {
+    lcek_frame** k;
+    int* depth;
+    struct lcek_run* prev;
+} lcek_run;
+
+lcek_run* lcek_runs = NULL;
+
+/* Stands in a frame's list for the element being evaluated, so nothing
+ * holds that element twice. Static, so releasing it does nothing */
+lval lcek_hole;
+
+/* Start evaluating the list v in frame f */
+void lcek_enter(lcek_frame* f, lval* v) {
+    f->v = v;
+    f->fun = lval_eval_head(v);
+    f->i = f->fun ? 1 : 0;
+    f->strategy = LVAL_LIST_ANY;
+}
+
+/* Evaluate v on the explicit stack, consumes v */
+lval* lcek_eval(lenv* e, lval* v) {
+    lcek_hole.type = LVAL_SEXPR;
+    lcek_hole.mark = LVAL_STATIC;
+    lcek_hole.refs = 2;
+
+    int roots = gc_root_count;
+    int cap = 64;
+    int depth = 0;
+    lcek_frame* k = lmem_alloc(LMEM_STACK, sizeof(lcek_frame) * cap);
+    lcek_run run = { &k, &depth, lcek_runs };
+    lcek_runs = &run;
+
+    // The control, and a value on it's way back to the top frame
+    lval* x = v;
+    lval* r = NULL;
+    GC_ROOT(x);
+    GC_ROOT(r);
+    int base = gc_root_count;
+
+    for (;;) {
+        if (x != NULL) {
+            gc_safepoint(e);
+            if (lmem_over_limit(e)) { break; }
+            lcek_counters.steps++;
+
+            if (LVAL_TYPE(x) == LVAL_SYM) {
+                r = lenv_get(e, x);
+                lval_del(x);
+            } else if (LVAL_TYPE(x) == LVAL_SEXPR) {
+                // Push a frame, rooting the frames again if they move
+                if (depth == cap) {
+                    k = lmem_realloc(LMEM_STACK, k, sizeof(lcek_frame) * cap, sizeof(lcek_frame) * cap * 2);
+                    cap *= 2;
+                    gc_root_count = base;
+                    for (int j = 0; j < depth; j++) { GC_ROOT(k[j].v); }
+                }
+                lcek_enter(&k[depth], lval_unshare(x));
+                gc_root_count = base + depth;
+                GC_ROOT(k[depth].v);
+                depth++;
+                lcek_counters.frames++;
+                if (++lcek_counters.depth > lcek_counters.peak) { lcek_counters.peak = lcek_counters.depth; }
+            } else {
+                r = x;
+            }
+            x = NULL;
+        }
+
+        if (depth == 0) { break; }
+        lcek_frame* f = &k[depth - 1];
+
+        // Fill in the element the top frame was waiting for
+        if (r != NULL) {
+            f->v->cell[f->i] = r;
+            gc_write_barrier(f->v, r);
+            f->strategy = lval_eval_strategy(f->strategy, f->i, r);
+            f->i++;
+            r = NULL;
+        }
+
+        // Go on to it's next element, or apply it once they're all done
+        if (f->i < f->v->count) {
+            x = f->v->cell[f->i];
+            f->v->cell[f->i] = &lcek_hole;
+            continue;
+        }
+
+        lval* tail = NULL;
+        r = lval_eval_apply(e, f->v, f->fun, f->strategy, &tail);
+        gc_root_count = base + depth;
+        if (tail != NULL) {
+            lcek_enter(f, lval_eval_source(tail));
+            lcek_counters.tail_calls++;
+            continue;
+        }
+        depth--;
+        lcek_counters.depth--;
+        gc_root_count = base + depth;
+    }
+
+    // Abandon a runaway evaluation, as lval_eval does
+    if (x != NULL) {
+        lval_del(x);
+        for (int j = 0; j < depth; j++) { lval_del(k[j].v); }
+        lcek_counters.depth -= depth;
+        r = lval_err(LERR_MEM_LIMIT, lmem_limit);
+    }
+
+    gc_root_count = roots;
+    lcek_runs = run.prev;
+    lmem_free(LMEM_STACK, k, sizeof(lcek_frame) * cap);
+    return r;
 }
 
 /* get the head of a Qexpr */
 lval* builtin_head(lenv* e, lval* a) {
     // check error conditions
-    LASSERT(a, a->count == 1, "Function 'head' passed too many arguments. "
-    "Got %i, expected %i.",
-    a->count, 1); 
-
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'head' passed incorrect type for argument 1."
-    "Got %s, expected %s.",
-    ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+    LASSERT(a, a->count == 1, LERR_TOO_MANY_ARGS, "head", a->count, 1); 
 
-    LASSERT(a, a->cell[0]->count != 0, "Function 'head' passed nothing.")
+    LASSERT(a, LVAL_TYPE(a->cell[0]) == LVAL_QEXPR || LVAL_TYPE(a->cell[0]) == LVAL_CONS, LERR_ARG_TYPE, "head", 1, LVAL_TYPE(a->cell[0]), LVAL_QEXPR);
 
-    // Otherwise, take first argument
-    lval* v = lval_take(a, 0);
+    LASSERT(a, a->cell[0]->count != 0, LERR_NOTHING, "head")
 
-    // Delete all non-head elements then return
-    while (v->count > 1) { lval_del(lval_pop(v, 1)); }
+    // Otherwise, take first argument and keep only it's head
+    lval* q = lval_take(a, 0);
+    if (q->type == LVAL_CONS) {
+        lval* v = lval_cons(lval_retain(q->car), lval_qexpr());
+        lval_del(q);
+        return v;
+    }
+    lval* v = lval_add(lval_qexpr(), lval_retain(lvec_first(q)));
+    lval_del(q);
     return v;
 }
 
 /* get the tail of a Qexpr */
 lval* builtin_tail(lenv* e, lval* a) {
     // check errors
-    LASSERT(a, a->count == 1, "Function 'tail' passed too many arguments."
-    "Got %i, expected %i.",
-    a->count, 1); 
+    LASSERT(a, a->count == 1, LERR_TOO_MANY_ARGS, "tail", a->count, 1); 
 
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'tail' passed incorrect type for argument 1. "
-    "Got %s, expected %s.",
-    ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+    LASSERT(a, LVAL_TYPE(a->cell[0]) == LVAL_QEXPR || LVAL_TYPE(a->cell[0]) == LVAL_CONS, LERR_ARG_TYPE, "tail", 1, LVAL_TYPE(a->cell[0]), LVAL_QEXPR);
 
-    LASSERT(a, a->cell[0]->count != 0, "Function 'tail' passed nothing.");
+    LASSERT(a, a->cell[0]->count != 0, LERR_NOTHING, "tail");
 
-    // Take first arg, dispose and return
-    lval *v = lval_take(a, 0);
-    lval_del(lval_pop(v, 0));
-    return v;
+    // The tail of a cons list is just it's cdr
+    lval* q = lval_take(a, 0);
+    if (q->type == LVAL_CONS) {
+        lval* v = lval_retain(q->cdr);
+        lval_del(q);
+        return v;
+    }
+
+    // Take first arg, the rest shares structure with it
+    return lvec_tail(q);
 }
 
 /* convert S-Expression to Qexpr and return */
@@ -570,42 +3390,29 @@ lval* builtin_list(lenv* e, lval* a) {
 
 /* eval a Q-expr by converting to s-expr */
 lval* builtin_eval(lenv* e, lval* a) {
-    LASSERT(a, a->count == 1, "Function 'eval' passed too many arguments."
-    "Got %i, expected %i.",
-    a->count, 1); 
+    LASSERT(a, a->count == 1, LERR_TOO_MANY_ARGS, "eval", a->count, 1); 
 
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'eval' passed incorrect type for argument 1. "
-    "Got %s expected %s.",
-    ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+    LASSERT(a, LVAL_TYPE(a->cell[0]) == LVAL_QEXPR, LERR_ARG_TYPE, "eval", 1, LVAL_TYPE(a->cell[0]), LVAL_QEXPR);
 
+    // The VM runs the list as it is, the tree-walker needs it's own copy
     lval* x = lval_take(a, 0);
-    x->type = LVAL_SEXPR;
-    return lval_eval(e, x);
-}
-
-lval* lval_join(lenv* e, lval* x, lval* y) {
-    // add each cell in y to x
-    while (y->count) {
-        x = lval_add(x, lval_pop(y, 0));
-    }
-
-    // Delete empty y, return x
-    lval_del(y);
-    return x;
+    if (leval == LEVAL_VM) { return lvm_eval(e, x); }
+    if (leval == LEVAL_CEK) { return lcek_eval(e, lval_eval_source(x)); }
+    return lval_eval(e, lval_eval_source(x));
 }
 
 /* join Q-Exprs */
 lval* builtin_join(lenv* e, lval* a) {
+    LASSERT(a, a->count > 0, LERR_NO_ARGS, "join");
+
     for (int i = 0; i < a->count; i++) {
-        LASSERT(a, a->cell[i]->type == LVAL_QEXPR,"Function 'join' passed incorrect type for argument %i. "
-        "Got %s, expected %s",
-        i+1, ltype_name(a->cell[i]->type), ltype_name(LVAL_QEXPR));
+        LASSERT(a, LVAL_TYPE(a->cell[i]) == LVAL_QEXPR,LERR_ARG_TYPE, "join", i+1, LVAL_TYPE(a->cell[i]), LVAL_QEXPR);
     }
 
     lval* x = lval_pop(a, 0);
 
     while (a->count) {
-        x=lval_join(e, x, lval_pop(a, 0));
+        x = lvec_concat(x, lval_pop(a, 0));
     }
 
     lval_del(a);
@@ -614,30 +3421,27 @@ lval* builtin_join(lenv* e, lval* a) {
 
 /* function definition */
 lval* builtin_def(lenv* e, lval* a) {
-    LASSERT(a, a->cell[0]->type == LVAL_QEXPR, "Function 'def' passed incorrect type for argument 1. "
-    "Got %s, expected %s",
-    ltype_name(a->cell[0]->type), ltype_name(LVAL_QEXPR));
+    LASSERT(a, a->count > 0, LERR_NO_ARGS, "def");
+
+    LASSERT(a, LVAL_TYPE(a->cell[0]) == LVAL_QEXPR, LERR_ARG_TYPE, "def", 1, LVAL_TYPE(a->cell[0]), LVAL_QEXPR);
 
     // First arg is list of symbols
+    a->cell[0] = lvec_flatten(a->cell[0]);
+    gc_write_barrier(a, a->cell[0]);
     lval* syms = a->cell[0];
 
     // Ensure all elements of list are symbols
     for (int i = 0; i < syms->count; i++) {
-        LASSERT(a, syms->cell[i]->type == LVAL_SYM, "Function 'def' expected a symbol at argument %i, instead got %s.", i+1, ltype_name(syms->cell[i]->type));
+        LASSERT(a, LVAL_TYPE(syms->cell[i]) == LVAL_SYM, LERR_NOT_SYMBOL, "def", i+1, LVAL_TYPE(syms->cell[i]));
     }
     // Check correct number of symbols to values
-    LASSERT(a, syms->count == a->count-1, "Incorrect number of values passed. "
-    "Expected %i, got %i.",
-    syms->count, a->count-1);
+    LASSERT(a, syms->count == a->count-1, LERR_VALUE_COUNT, syms->count, a->count-1);
 
-    int len = sizeof(builtins)/sizeof(builtins[0]);
-
-    // Assign *copies* of values to symbols
+    // Bind values to symbols, the environment shares them
     for (int i = 0; i < syms->count; i++) {
         // Check symbol is not already a builtin
-        for (int i = 0; i < len; i++) {
-            LASSERT(a, !strcmp(syms->cell[i]->, builtins[i]), "Cannot redefine builtin function '%s'.", builtins[i]);
-        }
+        char* name = LVAL_ATOM(syms->cell[i])->name;
+        LASSERT(a, lbuiltin_find(name) < 0, LERR_REDEFINE, name);
         lenv_put(e, syms->cell[i], a->cell[i+1]);
     }
 
@@ -645,11 +3449,410 @@ lval* builtin_def(lenv* e, lval* a) {
     return lval_sexpr();
 }
 
+/* put a value on the front of a cons list */
+lval* builtin_cons(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, LERR_ARG_COUNT, "cons", a->count, 2);
+
+    // The empty Q-Expression ends every cons list
+    LASSERT(a, LVAL_TYPE(a->cell[1]) == LVAL_CONS || (LVAL_TYPE(a->cell[1]) == LVAL_QEXPR && a->cell[1]->count == 0),
+    LERR_ARG_TYPE, "cons", 2, LVAL_TYPE(a->cell[1]), LVAL_CONS);
+
+    lval* x = lval_pop(a, 0);
+    return lval_cons(x, lval_take(a, 0));
+}
+
+/* convert a Q-Expression to a cons list */
+lval* builtin_to_cons(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LERR_TOO_MANY_ARGS, "to-cons", a->count, 1);
+
+    LASSERT(a, LVAL_TYPE(a->cell[0]) == LVAL_QEXPR, LERR_ARG_TYPE, "to-cons", 1, LVAL_TYPE(a->cell[0]), LVAL_QEXPR);
+
+    // Build from the back so each cell is consed on in O(1)
+    lval* q = lvec_flatten(lval_take(a, 0));
+    lval* x = lval_qexpr();
+    for (int i = q->count - 1; i >= 0; i--) {
+        x = lval_cons(lval_retain(q->cell[i]), x);
+    }
+    lval_del(q);
+    return x;
+}
+
+/* convert a cons list back to a Q-Expression */
+lval* builtin_to_list(lenv* e, lval* a) {
+    LASSERT(a, a->count == 1, LERR_TOO_MANY_ARGS, "to-list", a->count, 1);
+
+    LASSERT(a, LVAL_TYPE(a->cell[0]) == LVAL_CONS || LVAL_TYPE(a->cell[0]) == LVAL_QEXPR, LERR_ARG_TYPE, "to-list", 1, LVAL_TYPE(a->cell[0]), LVAL_CONS);
+
+    lval* l = lval_take(a, 0);
+    if (l->type == LVAL_QEXPR) { return l; }
+
+    lval* x = lval_qexpr();
+    for (lval* p = l; p->type == LVAL_CONS; p = p->cdr) {
+        x = lval_add(x, lval_retain(p->car));
+    }
+    lval_del(l);
+    return x;
+}
+
+/* Pairs of lists being compared, with the index of the next elements. A
+ * cons frame walks the two chains instead, the others own flat copies.
+ * On a heap stack, so nesting is only limited by memory */
+typedef struct leq_frame {
+    lval* a;
+    lval* b;
+    int i;
+    int cons;
+} leq_frame;
+
+leq_frame* lval_eq_open = NULL;
+int lval_eq_count = 0;
+int lval_eq_cap = 0;
+
+void lval_eq_push(lval* a, lval* b, int cons) {
+    if (lval_eq_count == lval_eq_cap) {
+        lval_eq_cap = lval_eq_cap ? lval_eq_cap * 2 : 64;
+        lval_eq_open = realloc(lval_eq_open, sizeof(leq_frame) * lval_eq_cap);
+    }
+    lval_eq_open[lval_eq_count++] = (leq_frame){ a, b, 0, cons };
+}
+
+/* Structural equality */
+int lval_eq(lval* a, lval* b) {
+    int base = lval_eq_count;
+    int eq = 1;
+
+    for (;;) {
+        if (a != NULL) {
+            if (a == b) {
+                eq = 1;
+            } else if (LVAL_TYPE(a) != LVAL_TYPE(b)) {
+                eq = 0;
+            } else switch (LVAL_TYPE(a)) {
+                case LVAL_LINT: eq = LVAL_LINT_VAL(a) == LVAL_LINT_VAL(b); break;
+                case LVAL_DEC: eq = LVAL_DEC_VAL(a) == LVAL_DEC_VAL(b); break;
+                case LVAL_SYM: eq = LVAL_ATOM(a) == LVAL_ATOM(b); break;
+                case LVAL_ERR: eq = lerr_same(a, b); break;
+                case LVAL_FUN: eq = a->fun == b->fun; break;
+                case LVAL_CONS:
+                    eq = a->count == b->count;
+                    if (eq) { lval_eq_push(a, b, 1); }
+                    break;
+                default:
+                    // Equal interned lists are always the same value
+                    eq = !((a->mark & LVAL_HASHED) && (b->mark & LVAL_HASHED)) && a->count == b->count;
+
+                    // Compare trees leaf by leaf through flat copies
+                    if (eq) { lval_eq_push(lvec_flatten(lval_retain(a)), lvec_flatten(lval_retain(b)), 0); }
+                    break;
+            }
+            a = NULL;
+        }
+
+        if (lval_eq_count == base) { break; }
+        leq_frame* f = &lval_eq_open[lval_eq_count - 1];
+
+        // Compare the next pair, or give up on the lists at the first difference
+        if (eq && f->cons && f->a->type == LVAL_CONS) {
+            a = f->a->car;
+            b = f->b->car;
+            f->a = f->a->cdr;
+            f->b = f->b->cdr;
+            continue;
+        }
+        if (eq && !f->cons && f->i < f->a->count) {
+            a = f->a->cell[f->i];
+            b = f->b->cell[f->i];
+            f->i++;
+            continue;
+        }
+        if (!f->cons) {
+            lval_del(f->a);
+            lval_del(f->b);
+        }
+        lval_eq_count--;
+    }
+    return eq;
+}
+
+/* compare two values, 1 if they are equal, 0 otherwise */
+lval* builtin_eq(lenv* e, lval* a) {
+    LASSERT(a, a->count == 2, LERR_ARG_COUNT, "==", a->count, 2);
+
+    int eq = lval_eq(a->cell[0], a->cell[1]);
+    lval_del(a);
+    return lval_lint(eq);
+}
+
+/* collector statistics */
+lval* builtin_gc_stats(lenv* e, lval* a) {
+    LASSERT(a, a->count == 0, LERR_TOO_MANY_ARGS, "gc-stats", a->count, 0);
+    lval_del(a);
+
+    lval* x = lval_qexpr();
+    x = lval_add(x, lval_sym("collections"));
+    x = lval_add(x, lval_lint(gc_counters.collections));
+    x = lval_add(x, lval_sym("minor-collections"));
+    x = lval_add(x, lval_lint(gc_counters.minor_collections));
+    x = lval_add(x, lval_sym("promoted"));
+    x = lval_add(x, lval_lint(gc_counters.promoted));
+    x = lval_add(x, lval_sym("pause-total-ms"));
+    x = lval_add(x, lval_dec(gc_counters.pause_total * 1000));
+    x = lval_add(x, lval_sym("pause-max-ms"));
+    x = lval_add(x, lval_dec(gc_counters.pause_max * 1000));
+    x = lval_add(x, lval_sym("slices"));
+    x = lval_add(x, lval_lint(gc_counters.slices));
+
+    // Non-empty buckets as {upper-bound-us count}
+    lval* hist = lval_qexpr();
+    for (int i = 0; i < GC_PAUSE_BUCKETS; i++) {
+        if (gc_counters.pause_hist[i] == 0) { continue; }
+        lval* b = lval_qexpr();
+        b = lval_add(b, lval_lint(1L << i));
+        b = lval_add(b, lval_lint(gc_counters.pause_hist[i]));
+        hist = lval_add(hist, b);
+    }
+    x = lval_add(x, lval_sym("pause-histogram-us"));
+    x = lval_add(x, hist);
+    x = lval_add(x, lval_sym("reclaimed-bytes"));
+    x = lval_add(x, lval_lint(gc_counters.bytes_reclaimed));
+    return x;
+}
+
+/* environment statistics */
+lval* builtin_env_stats(lenv* e, lval* a) {
+    LASSERT(a, a->count == 0, LERR_TOO_MANY_ARGS, "env-stats", a->count, 0);
+    lval_del(a);
+
+    lval* x = lval_qexpr();
+    x = lval_add(x, lval_sym("bindings"));
+    x = lval_add(x, lval_lint(e->count));
+    x = lval_add(x, lval_sym("cells"));
+    x = lval_add(x, lval_lint(e->cells));
+    x = lval_add(x, lval_sym("ic-hits"));
+    x = lval_add(x, lval_lint(lcall_hits));
+    x = lval_add(x, lval_sym("ic-misses"));
+    x = lval_add(x, lval_lint(lcall_misses));
+    x = lval_add(x, lval_sym("slots"));
+    x = lval_add(x, lval_lint(e->cap));
+    x = lval_add(x, lval_sym("load-factor"));
+    x = lval_add(x, lval_dec(lenv_load_factor(e)));
+    return x;
+}
+
+/* explicit stack evaluator statistics, depth being the frames under this
+ * call */
+lval* builtin_stack_stats(lenv* e, lval* a) {
+    LASSERT(a, a->count == 0, LERR_TOO_MANY_ARGS, "stack-stats", a->count, 0);
+    lval_del(a);
+
+    lval* x = lval_qexpr();
+    x = lval_add(x, lval_sym("depth"));
+    x = lval_add(x, lval_lint(lcek_counters.depth));
+    x = lval_add(x, lval_sym("peak"));
+    x = lval_add(x, lval_lint(lcek_counters.peak));
+    x = lval_add(x, lval_sym("frames"));
+    x = lval_add(x, lval_lint(lcek_counters.frames));
+    x = lval_add(x, lval_sym("tail-calls"));
+    x = lval_add(x, lval_lint(lcek_counters.tail_calls));
+    x = lval_add(x, lval_sym("steps"));
+    x = lval_add(x, lval_lint(lcek_counters.steps));
+    return x;
+}
+
+/* The explicit stack evaluator's live frames, innermost first, each as
+ * {kind list index}. The kind is builtin when the head was found through
+ * the inline cache and call otherwise, index is the element being
+ * evaluated, shown in the list as _. The innermost frame is this call,
+ * whose list is a itself, so the frames are read before a is released.
+ * The other evaluators have no frames to show */
+lval* builtin_stack_frames(lenv* e, lval* a) {
+    LASSERT(a, a->count == 0, LERR_TOO_MANY_ARGS, "stack-frames", a->count, 0);
+
+    lval* x = lval_qexpr();
+    for (lcek_run* run = lcek_runs; run != NULL; run = run->prev) {
+        for (int j = *run->depth - 1; j >= 0; j--) {
+            lcek_frame* f = &(*run->k)[j];
+            lval* l = lval_qexpr();
+            for (int i = 0; i < f->v->count; i++) {
+                lval* c = f->v->cell[i];
+                l = lval_add(l, c == &lcek_hole ? lval_sym("_") : lval_retain(c));
+            }
+            lval* frame = lval_qexpr();
+            frame = lval_add(frame, lval_sym(f->fun ? "builtin" : "call"));
+            frame = lval_add(frame, l);
+            frame = lval_add(frame, lval_lint(f->i));
+            x = lval_add(x, frame);
+        }
+    }
+    lval_del(a);
+    return x;
+}
+
+/* JIT statistics: code compiled to native code and rejected as
+ * unsupported, native runs, bail outs and bytes of native code live */
+lval* builtin_jit_stats(lenv* e, lval* a) {
+    LASSERT(a, a->count == 0, LERR_TOO_MANY_ARGS, "jit-stats", a->count, 0);
+    lval_del(a);
+
+    lval* x = lval_qexpr();
+    x = lval_add(x, lval_sym("compiled"));
+    x = lval_add(x, lval_lint(ljit_counters.compiled));
+    x = lval_add(x, lval_sym("rejected"));
+    x = lval_add(x, lval_lint(ljit_counters.rejected));
+    x = lval_add(x, lval_sym("runs"));
+    x = lval_add(x, lval_lint(ljit_counters.runs));
+    x = lval_add(x, lval_sym("bailouts"));
+    x = lval_add(x, lval_lint(ljit_counters.bailouts));
+    x = lval_add(x, lval_sym("bytes"));
+    x = lval_add(x, lval_lint(ljit_counters.bytes));
+    return x;
+}
+
+/* Bytes held by the lvals of each type, found by walking every slab, the
+ * nursery and the arena. Garbage not yet swept is still counted */
+void lmem_by_type(long* bytes) {
+    for (lslab* s = lval_slabs; s != NULL; s = s->next) {
+        int used = (s == lval_slabs) ? lval_slab_used : LVAL_SLAB_SIZE;
+        for (int i = 0; i < used; i++) {
+            if (s->vals[i].type < LVAL_NUM_TYPES) { bytes[s->vals[i].type] += lval_bytes(&s->vals[i]); }
+        }
+    }
+    for (int i = 0; i < gc_nursery_used; i++) {
+        if (gc_nursery[i].type < LVAL_NUM_TYPES) { bytes[gc_nursery[i].type] += lval_bytes(&gc_nursery[i]); }
+    }
+    for (larena_chunk* c = gc_arena_cur ? gc_arena : NULL; c != NULL; c = c->next) {
+        int used = (c == gc_arena_cur) ? gc_arena_used : GC_ARENA_CHUNK;
+        for (int i = 0; i < used; i++) { bytes[c->vals[i].type] += lval_bytes(&c->vals[i]); }
+        if (c == gc_arena_cur) { break; }
+    }
+}
+
+/* memory statistics: bytes by kind and by lval type, then the slab
+ * allocator's live, peak, recycled and slab counts under alloc */
+lval* builtin_mem_stats(lenv* e, lval* a) {
+    LASSERT(a, a->count == 0, LERR_TOO_MANY_ARGS, "mem-stats", a->count, 0);
+    lval_del(a);
+
+    char* kinds[LMEM_KINDS] = { "cells", "env", "interned", "code", "stack" };
+    char* types[LVAL_NUM_TYPES] = { "integer", "decimal", "error", "symbol", "function", "sexpr", "qexpr", "cons" };
+    long bytes[LVAL_NUM_TYPES] = { 0 };
+    lmem_by_type(bytes);
+
+    lval* x = lval_qexpr();
+    x = lval_add(x, lval_sym("current"));
+    x = lval_add(x, lval_lint(lmem_used()));
+    x = lval_add(x, lval_sym("peak"));
+    x = lval_add(x, lval_lint(lmem_peak));
+    x = lval_add(x, lval_sym("limit"));
+    x = lval_add(x, lval_lint(lmem_limit));
+    x = lval_add(x, lval_sym("lvals"));
+    x = lval_add(x, lval_lint(lval_counters.live * (long)sizeof(lval)));
+    for (int k = 0; k < LMEM_KINDS; k++) {
+        x = lval_add(x, lval_sym(kinds[k]));
+        x = lval_add(x, lval_lint(lmem_bytes[k]));
+    }
+
+    // {type bytes} for each lval type, including the cells they own
+    lval* t = lval_qexpr();
+    for (int i = 0; i < LVAL_NUM_TYPES; i++) {
+        lval* b = lval_add(lval_qexpr(), lval_sym(types[i]));
+        b = lval_add(b, lval_lint(bytes[i]));
+        t = lval_add(t, b);
+    }
+    x = lval_add(x, lval_sym("types"));
+    x = lval_add(x, t);
+
+    // Slab allocator counters, in lvals rather than bytes
+    lval_stats st = lval_alloc_stats();
+    lval* c = lval_qexpr();
+    c = lval_add(c, lval_sym("live"));
+    c = lval_add(c, lval_lint(st.live));
+    c = lval_add(c, lval_sym("peak"));
+    c = lval_add(c, lval_lint(st.peak));
+    c = lval_add(c, lval_sym("recycled"));
+    c = lval_add(c, lval_lint(st.recycled));
+    c = lval_add(c, lval_sym("slabs"));
+    c = lval_add(c, lval_lint(st.slabs));
+    x = lval_add(x, lval_sym("alloc"));
+    x = lval_add(x, c);
+    return x;
+}
+
+typedef struct lbuiltin_info {
+    char* name;
+    lbuiltin fun;
+} lbuiltin_info;
+
+#define LBUILTIN_INFO(id, name, fun) { name, fun },
+lbuiltin_info lbuiltin_table[LBUILTIN_COUNT] = { LILSP_BUILTINS(LBUILTIN_INFO) };
+
+/* Whether fun is one of the runtime builtins, which take no arguments */
+int lbuiltin_nullary(lbuiltin fun) {
+    for (int i = LBUILTIN_GC_STATS; i < LBUILTIN_COUNT; i++) {
+        if (lbuiltin_table[i].fun == fun) { return 1; }
+    }
+    return 0;
+}
+
+/* Perfect hash from builtin name to id, built at startup by hash and
+ * displace. The names are split into one bucket per builtin, then every
+ * bucket, largest first, is given the first seed that sends all it's
+ * names to free slots. A lookup is two hashes and one string compare */
+#define LBUILTIN_SLOTS (2 * LBUILTIN_COUNT)
+
+unsigned long lbuiltin_seed[LBUILTIN_COUNT];
+/* id + 1 of the builtin in each slot, 0 for none */
+int lbuiltin_slots[LBUILTIN_SLOTS];
+
+unsigned long lbuiltin_hash(char* name, unsigned long seed) {
+    // FNV-1a from a seeded basis, then mixed so every bit of the seed
+    // moves the slot
+    uint64_t h = 14695981039346656037u ^ (seed * 0x9E3779B97F4A7C15u);
+    for (; *name; name++) { h = (h ^ (unsigned char)*name) * 1099511628211u; }
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDu;
+    h ^= h >> 33;
+    return (unsigned long)h;
+}
+
+void lbuiltin_init(void) {
+    int bucket[LBUILTIN_COUNT];
+    int size[LBUILTIN_COUNT] = { 0 };
+    memset(lbuiltin_slots, 0, sizeof(lbuiltin_slots));
+    for (int i = 0; i < LBUILTIN_COUNT; i++) {
+        bucket[i] = lbuiltin_hash(lbuiltin_table[i].name, 0) % LBUILTIN_COUNT;
+        size[bucket[i]]++;
+    }
+
+    for (int n = LBUILTIN_COUNT; n > 0; n--) {
+        for (int b = 0; b < LBUILTIN_COUNT; b++) {
+            if (size[b] != n) { continue; }
+            for (unsigned long seed = 1; ; seed++) {
+                // Claim a slot per name, giving them back on a clash
+                int placed = 0, ok = 1;
+                int slot[LBUILTIN_COUNT];
+                for (int i = 0; i < LBUILTIN_COUNT && ok; i++) {
+                    if (bucket[i] != b) { continue; }
+                    slot[placed] = lbuiltin_hash(lbuiltin_table[i].name, seed) % LBUILTIN_SLOTS;
+                    if (lbuiltin_slots[slot[placed]]) { ok = 0; break; }
+                    lbuiltin_slots[slot[placed++]] = i + 1;
+                }
+                if (ok) { lbuiltin_seed[b] = seed; break; }
+                while (placed > 0) { lbuiltin_slots[slot[--placed]] = 0; }
+            }
+        }
+    }
+}
+
+/* Id of the builtin called name, or -1 */
+int lbuiltin_find(char* name) {
+    unsigned long seed = lbuiltin_seed[lbuiltin_hash(name, 0) % LBUILTIN_COUNT];
+    int i = lbuiltin_slots[lbuiltin_hash(name, seed) % LBUILTIN_SLOTS] - 1;
+    return (i >= 0 && strcmp(lbuiltin_table[i].name, name) == 0) ? i : -1;
+}
+
 /* add builtins to environment */
 void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
-    for (int i = 0; i < MAX_BUILTINS; i++) {
-        if (strcmp(builtins[i]))
-    }
     lval* k = lval_sym(name);
     lval* v = lval_fun(func);
     lenv_put(e, k, v);
@@ -658,25 +3861,47 @@ void lenv_add_builtin(lenv* e, char* name, lbuiltin func) {
 }
 
 void lenv_add_builtins(lenv* e) {
-    // List funcs
-    lenv_add_builtin(e, "list", builtin_list);
-    lenv_add_builtin(e, "head", builtin_head);
-    lenv_add_builtin(e, "tail", builtin_tail);
-    lenv_add_builtin(e, "eval", builtin_eval);
-    lenv_add_builtin(e, "join", builtin_join);
-    lenv_add_builtin(e, "def", builtin_def);
-
-    // Math functions
-    lenv_add_builtin(e, "+", builtin_add);
-    lenv_add_builtin(e, "-", builtin_head);
-    lenv_add_builtin(e, "*", builtin_mul);
-    lenv_add_builtin(e, "/", builtin_div);
-    lenv_add_builtin(e, "%", builtin_mod);
+    lbuiltin_init();
+    for (int i = 0; i < LBUILTIN_COUNT; i++) {
+        lenv_add_builtin(e, lbuiltin_table[i].name, lbuiltin_table[i].fun);
+    }
 }
 
-
-
 int main(int argc, char** argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--gc=rc") == 0) {
+            lmm = LMM_RC;
+        } else if (strcmp(argv[i], "--gc=mark-sweep") == 0) {
+            lmm = LMM_MARK_SWEEP;
+        } else if (strcmp(argv[i], "--gc=generational") == 0) {
+            lmm = LMM_GENERATIONAL;
+            gc_nursery = malloc(sizeof(lval) * GC_NURSERY_SIZE);
+        } else if (strcmp(argv[i], "--gc=incremental") == 0) {
+            lmm = LMM_INCREMENTAL;
+        } else if (strcmp(argv[i], "--gc=arena") == 0) {
+            lmm = LMM_ARENA;
+        } else if (strncmp(argv[i], "--gc-budget=", 12) == 0 && atol(argv[i] + 12) > 0) {
+            gc_budget = atol(argv[i] + 12);
+        } else if (strcmp(argv[i], "--hash-cons") == 0) {
+            lval_hashcons_on = 1;
+        } else if (strncmp(argv[i], "--mem-limit=", 12) == 0 && atol(argv[i] + 12) > 0) {
+            lmem_limit = atol(argv[i] + 12);
+        } else if (strcmp(argv[i], "--eval=vm") == 0) {
+            leval = LEVAL_VM;
+        } else if (strcmp(argv[i], "--eval=tree") == 0) {
+            leval = LEVAL_TREE;
+        } else if (strcmp(argv[i], "--eval=cek") == 0) {
+            leval = LEVAL_CEK;
+        } else if (strcmp(argv[i], "--jit=on") == 0) {
+            ljit_on = LJIT;
+        } else if (strcmp(argv[i], "--jit=off") == 0) {
+            ljit_on = 0;
+        } else {
+            fprintf(stderr, "usage: %s [--gc=rc|mark-sweep|generational|incremental|arena] [--gc-budget=N] [--hash-cons] [--mem-limit=BYTES] [--eval=vm|tree|cek] [--jit=on|off]\n", argv[0]);
+            return 1;
+        }
+    }
+
     /* Define RPN grammar */
     mpc_parser_t* Integer = mpc_new("integer");
     mpc_parser_t* Decimal = mpc_new("decimal");
@@ -693,7 +3918,7 @@ int main(int argc, char** argv) {
             integer     : /-?[0-9]+/ ;                                                      \
             decimal     : /-?[0-9]+\\.[0-9]+/ ;                                             \
             number      : <decimal> | <integer> ;                                           \
-            symbol      : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&]+/ ;                                \
+            symbol      : /[a-zA-Z0-9_+\\-*\\/\\\\=<>!&%]+/ ;                               \
             sexpr       : '(' <expr>* ')' ;                                                 \
             qexpr       : '{' <expr>* '}' ;                                                 \
             expr        : <number> | <symbol> | <sexpr> | <qexpr> ;                         \
@@ -706,37 +3931,69 @@ int main(int argc, char** argv) {
 
     lenv* e = lenv_new();
     lenv_add_builtins(e);
+    if (lmm == LMM_ARENA) { gc_arena_reset(); }
 
     // REPL
     while(1) {
         // output prompt and get input
         char* input = readline("lilsp> ");
-        
+        // EOF
+        if (input == NULL) { break; }
+
         add_history(input);
 
-        // Parse user input
-        mpc_result_t r;
-        // mpc_parse will parse input according to grammar then copy result into r.
-        // return 1 on success, 0 on failure
-        if (mpc_parse("<stdin>", input, Lilsp, &r)) {
-            // Print result of evaluation
-            lval* x = lval_eval(e, lval_read(r.output));
+        // Read user input, the memory limit is per line. mpc recurses on
+        // nesting, so the explicit stack evaluator has a reader of it's own
+        lmem_base = lmem_used();
+        lmem_tripped = 0;
+        lval* x = NULL;
+        if (leval == LEVAL_CEK) {
+            char* err = NULL;
+            x = lval_read_text(input, &err);
+            if (x == NULL && *err != '\0') {
+                printf("<stdin>:1:%d: error: unexpected '%c'\n", (int)(err - input) + 1, *err);
+            } else if (x == NULL) {
+                printf("<stdin>:1:%d: error: unexpected end of input\n", (int)(err - input) + 1);
+            }
+        } else {
+            mpc_result_t r;
+            // mpc_parse will parse input according to grammar then copy result into r.
+            // return 1 on success, 0 on failure
+            if (mpc_parse("<stdin>", input, Lilsp, &r)) {
+                x = lval_read(r.output);
+                // Clean up ast from memory
+                mpc_ast_delete(r.output);
+            } else {
+                // Print error on failure and clean up
+                mpc_err_print(r.error);
+                mpc_err_delete(r.error);
+            }
+        }
+
+        // Print result of evaluation
+        if (x != NULL) {
+            x = lval_number_sites(x);
+            if (leval == LEVAL_VM) {
+                lcode* c = lcode_compile(e, x);
+                lval_del(x);
+                x = lvm_run(e, c);
+                lcode_release(c);
+            } else if (leval == LEVAL_CEK) {
+                x = lcek_eval(e, x);
+            } else {
+                x = lval_eval(e, x);
+            }
             lval_println(x);
             lval_del(x);
-
-            // Clean up ast from memory
-            mpc_ast_delete(r.output);
-
-        } else {
-            // Print error on failure and clean up
-            mpc_err_print(r.error);
-            mpc_err_delete(r.error);
+            lcode_cache_trim();
+            if (lmm == LMM_ARENA) { gc_arena_reset(); }
         }
 
         free(input);
     }
 
     lenv_del(e);
+    gc_free_heap();
 
     // Clean up parsers
     mpc_cleanup(8, Integer, Decimal, Number, Symbol, Sexpr, Qexpr, Expr, Lilsp);